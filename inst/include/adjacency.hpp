@@ -0,0 +1,109 @@
+#ifndef H_PRUNER
+#include <vector>
+#include <stdexcept>
+#include "typedefs.hpp"
+#endif
+
+#ifndef H_PRUNER_ADJACENCY
+#define H_PRUNER_ADJACENCY 1
+
+//! Adjacency list in compressed sparse row (CSR) format
+/**
+ * The neighbors of node `i` are stored contiguously in `idx`, from
+ * `idx[off[i]]` to `idx[off[i + 1] - 1]`, so the whole list takes two
+ * allocations regardless of the number of nodes. `adj[i]` returns a view
+ * with the same interface as a `v_uint` (`size()`, `begin()`, `end()`,
+ * `operator[]`, and `at()`).
+ */
+class Adjacency {
+private:
+  v_uint off;
+  v_uint idx;
+
+public:
+
+  //! Neighbors of a single node
+  class Row {
+  private:
+    v_uint::const_iterator b, e;
+
+  public:
+    Row(v_uint::const_iterator b_, v_uint::const_iterator e_) : b(b_), e(e_) {};
+
+    v_uint::const_iterator begin() const {return b;};
+    v_uint::const_iterator end() const {return e;};
+    uint size() const {return (uint) (e - b);};
+    uint operator[](uint j) const {return *(b + j);};
+    uint at(uint j) const {
+      if (j >= this->size())
+        throw std::out_of_range("Adjacency::Row::at() out of range.");
+      return *(b + j);
+    };
+
+  };
+
+  Adjacency() : off(1u, 0u) {};
+
+  //! Builds the adjacency of `n` nodes from an edgelist
+  /**
+   * Adds `to[k]` to the neighbors of `from[k]`. The neighbors of each node
+   * keep the order in which they appear in the edgelist.
+   */
+  Adjacency(uint n, const v_uint & from, const v_uint & to);
+  ~Adjacency() {};
+
+  Row operator[](uint i) const {
+    return Row(idx.begin() + off[i], idx.begin() + off[i + 1u]);
+  };
+
+  Row at(uint i) const {
+    if (i >= this->size())
+      throw std::out_of_range("Adjacency::at() out of range.");
+    return (*this)[i];
+  };
+
+  //! Number of nodes
+  uint size() const {return (uint) off.size() - 1u;};
+
+  //! Number of edges
+  uint n_edges() const {return (uint) idx.size();};
+
+  //! Coerces the data into a vector of vectors
+  vv_uint as_vv_uint() const;
+
+  bool operator==(const Adjacency & other) const {
+    return (off == other.off) && (idx == other.idx);
+  };
+
+};
+
+inline Adjacency::Adjacency(uint n, const v_uint & from, const v_uint & to) :
+  off(n + 1u, 0u), idx(from.size()) {
+
+  // Counting the neighbors of each node
+  for (auto i = from.begin(); i != from.end(); ++i)
+    ++off[*i + 1u];
+
+  for (uint i = 0u; i < n; ++i)
+    off[i + 1u] += off[i];
+
+  // Filling, the cursor is where the next neighbor of each node goes
+  v_uint cursor(off.begin(), off.end() - 1);
+  for (uint k = 0u; k < from.size(); ++k)
+    idx[cursor[from[k]]++] = to[k];
+
+  return;
+
+}
+
+inline vv_uint Adjacency::as_vv_uint() const {
+
+  vv_uint ans(this->size());
+  for (uint i = 0u; i < this->size(); ++i)
+    ans[i].assign((*this)[i].begin(), (*this)[i].end());
+
+  return ans;
+
+}
+
+#endif
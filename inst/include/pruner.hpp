@@ -2,6 +2,11 @@
 #include <algorithm>
 #include <memory>
 #include <functional>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifndef H_PRUNER
 #define H_PRUNER
@@ -10,6 +15,7 @@
 namespace pruner {
 
 #include "typedefs.hpp"
+#include "adjacency.hpp"
 #include "treeiterator_bones.hpp"
 #include "tree_bones.hpp"
 
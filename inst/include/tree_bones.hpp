@@ -1,16 +1,19 @@
 #ifndef H_PRUNER
 #include <memory>
 #include <functional>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "typedefs.hpp"
+#include "adjacency.hpp"
 #include "treeiterator_bones.hpp"
 #endif
 
 #ifndef H_PRUNER_TREE_BONES
 #define H_PRUNER_TREE_BONES 1
 
-#ifndef MAX_TREE_SIZE
-#define MAX_TREE_SIZE 50000
-#endif
+// There is no limit on the number of nodes by default. Defining MAX_TREE_SIZE
+// makes the constructor reject node ids above it (return code 2).
 
 // Arbtrary set of arguments, this is the class that the creator function should
 // inherit. Ideally it should have:
@@ -36,17 +39,16 @@ template <typename Data_Type = bool>
 class Tree {
   
 protected:
-  bool is_dag_(int i = -1, int caller = -1, bool up_search = false);
-  void postorder_(uint i);
+  bool is_dag_();
   void postorder();
-  uint get_dist_tip2root_(uint start, uint count);
+  v_uint get_dist2closest_root() const;
   TreeIterator<Data_Type> iter;
   
 
-  //! Each nodes' parents.
-  vv_uint parents;
-  //! Each nodes' offspring.
-  vv_uint offspring;
+  //! Each nodes' parents (see Adjacency).
+  Adjacency parents;
+  //! Each nodes' offspring (see Adjacency).
+  Adjacency offspring;
   
   // Auxiliar variables
   //! List of already visited nodes (auxiliar)
@@ -70,6 +72,9 @@ protected:
   v_uint TIPS;
   v_uint DIST_TIPS2ROOT;
   
+  //! Nodes in POSTORDER grouped by their distance to the root (see get_levels)
+  vv_uint LEVELS;
+  
   friend Data_Type;
   friend class TreeIterator< Data_Type >;
   
@@ -116,13 +121,13 @@ public:
   // Getter --------------------------------------------------------------------
   
   // As pointers
-  const vv_uint * get_parents_ptr()   const {return &this->parents;};
-  const vv_uint * get_offspring_ptr() const {return &this->offspring;};
+  const Adjacency * get_parents_ptr()   const {return &this->parents;};
+  const Adjacency * get_offspring_ptr() const {return &this->offspring;};
   const v_uint * get_postorder_ptr()  const {return &this->POSTORDER;};
   
   // As data
-  vv_uint get_parents()   const {return this->parents;};
-  vv_uint get_offspring() const {return this->offspring;};
+  vv_uint get_parents()   const {return this->parents.as_vv_uint();};
+  vv_uint get_offspring() const {return this->offspring.as_vv_uint();};
   v_uint get_postorder()  const {return this->POSTORDER;};
   
   v_uint get_preorder()   const;
@@ -133,6 +138,18 @@ public:
   //! Distance of tips to the closest root
   v_uint get_dist_tip2root();
   
+  //! Distance of every node to the root (longest path) as seen from POSTORDER
+  v_uint get_dist2root() const;
+  
+  //! Nodes in POSTORDER grouped by distance to the root
+  /**
+   * `LEVELS[d]` lists the nodes that are `d` steps away from the root. Since
+   * the offspring of a node in level `d` are in levels `> d`, all the nodes
+   * in a level can be processed at the same time if the levels are visited
+   * from the deepest to the root (see prune_postorder_parallel).
+   */
+  const vv_uint & get_levels();
+  
   //! Returns the numner of nodes.
   uint n_nodes()          const {return this->N_NODES;};
   //! Returns the numner of edges.
@@ -177,6 +194,34 @@ public:
    */
   void prune_postorder(v_uint & seq);
   
+  //! Same as `prune_postorder`, but `fun` is called with `args_`
+  /** The tree is not modified (each call has its own iterator), so multiple
+   * threads can prune the same tree at the same time as long as each one
+   * passes its own `args_`.
+   * @param args_ Arguments passed to `fun` instead of `args`.
+   * @param seq Sequence to apply (POSTORDER by default).
+   */
+  void prune_postorder(Data_Type * args_) const;
+  void prune_postorder(Data_Type * args_, const v_uint & seq) const;
+  
+  //! Level-synchronous version of `prune_postorder`
+  /** Nodes are visited by wavefronts (see get_levels), going from the deepest
+   * level to the root. The nodes within a wavefront are distributed across
+   * `nthreads` OpenMP threads, so `fun` must be safe to call concurrently on
+   * different nodes. Without OpenMP this is equivalent to a serial traversal.
+   * @param nthreads Number of threads to use.
+   * @param args_ Arguments passed to `fun` (`args` if `nullptr`).
+   */
+  void prune_postorder_parallel(int nthreads, Data_Type * args_ = nullptr);
+  
+  //! Same as above, but visiting `levels` instead of get_levels()
+  /** Useful to prune a subset of POSTORDER, e.g., `LEVELS` without some of
+   * its nodes. `args_` must not be `nullptr`.
+   */
+  void prune_postorder_parallel(
+    int nthreads, Data_Type * args_, const vv_uint & levels
+  ) const;
+  
   //! Do the tree-traversal using the preorder
   /**
    * See Tree::prune_postorder.
@@ -13,6 +13,11 @@
 // Pruning ---------------------------------------------------------------------
  
 // Function to get the pre and post order
+//
+// Depth-first search that goes down through the offspring first and then up
+// through the parents, so the sequence can start from any node. An explicit
+// stack is used instead of recursion, so deep trees (e.g., caterpillars) don't
+// overflow the call stack.
 template <typename Data_Type>
 inline void Tree<Data_Type>::postorder() {
   
@@ -20,45 +25,51 @@ inline void Tree<Data_Type>::postorder() {
   if (this->POSTORDER.size() == 0u)
     POSTORDER.reserve(this->N_NODES);
   
-  // We can start the algorithm from any place
-  postorder_(0u);
-  POSTORDER.shrink_to_fit();
-  
-  this->reset_visited();
-  
-  return;
-}
-
-template <typename Data_Type>
-inline void Tree<Data_Type>::postorder_(uint i) {
+  // Each frame is a node and the next neighbor to check: offspring first, and
+  // parents after the node was added to the pruning sequence.
+  struct Frame {uint node, next;};
+  std::vector< Frame > stack;
+  stack.reserve(this->N_NODES);
   
-  // Setting the state to visited
-  this->visited[i] = true;
+  // We can start the algorithm from any place
+  this->visited[0u] = true;
+  stack.push_back({0u, 0u});
   
-  // First, check the offspring
-  for (uint j = 0u; j < this->offspring[i].size(); ++j) {
+  while (stack.size()) {
     
-    // Nothing to do here
-    if (this->visited[this->offspring[i][j]])
-      continue;
+    uint i = stack.back().node;
+    uint j = stack.back().next++;
     
-    postorder_(this->offspring[i][j]);
+    uint noff = this->offspring[i].size();
     
-  }
-  
-  // After visiting all of its childs, we need to add this node to the pruning
-  // sequence and continue with its parent(s).
-  POSTORDER.push_back(i);
-  for (uint j = 0u; j < this->parents[i].size(); ++j) {
+    // After visiting all of its childs, we need to add this node to the
+    // pruning sequence and continue with its parent(s).
+    if (j == noff)
+      POSTORDER.push_back(i);
+    
+    uint next;
+    if (j < noff)
+      next = this->offspring[i][j];
+    else if (j - noff < this->parents[i].size())
+      next = this->parents[i][j - noff];
+    else {
+      stack.pop_back();
+      continue;
+    }
     
     // Nothing to do here
-    if (this->visited[this->parents[i][j]])
+    if (this->visited[next])
       continue;
     
-    postorder_(this->parents[i][j]);
+    this->visited[next] = true;
+    stack.push_back({next, 0u});
     
   }
   
+  POSTORDER.shrink_to_fit();
+  
+  this->reset_visited();
+  
   return;
 }
 
@@ -141,7 +152,7 @@ inline void Tree<Data_Type>::print(bool details) const {
 // Return codes:
 // 0: OK
 // 1: Sizes of parent and offspring differ
-// 2: MAX_TREE_SIZE reached.
+// 2: MAX_TREE_SIZE reached (only if defined).
 // 3: Disconnected tree
 // 4: Not a Dag.
 template <typename Data_Type>
@@ -156,10 +167,12 @@ inline Tree<Data_Type>::Tree(const v_uint & parents_, const v_uint & offspring_,
   // Checking ranges
   uint maxid = 0u, m = parents_.size();
   for (uint i = 0u; i < m; ++i) {
+#ifdef MAX_TREE_SIZE
     if ((parents_[i] > MAX_TREE_SIZE) || (offspring_[i] > MAX_TREE_SIZE)) {
       out = 2u;
       return;
     }
+#endif
     
     if (maxid < parents_[i])
       maxid = parents_[i];
@@ -167,19 +180,13 @@ inline Tree<Data_Type>::Tree(const v_uint & parents_, const v_uint & offspring_,
       maxid = offspring_[i];
   }
   
-  // Resizing the vectors
-  this->parents.resize(maxid + 1u);
-  this->offspring.resize(maxid + 1u);
+  // Adding the data (see Adjacency)
+  this->offspring = Adjacency(maxid + 1u, parents_, offspring_);
+  this->parents   = Adjacency(maxid + 1u, offspring_, parents_);
   
   this->visited.resize(maxid + 1u, false);
   this->visit_counts.resize(maxid + 1u, 0u);
   
-  // Adding the data
-  for (uint i = 0u; i < m; ++i) {
-    this->offspring[parents_[i]].push_back(offspring_[i]);
-    this->parents[offspring_[i]].push_back(parents_[i]);
-  }
-  
   
   // Constants
   this->N_NODES = (uint) maxid + 1u;
@@ -221,7 +228,7 @@ inline Tree<Data_Type>::Tree(const v_uint & parents_, const v_uint & offspring_,
   
 }
 
-// A recursive function to check whether the tree is a DAG or not. -------------
+// Checks whether the tree is a DAG or not. ------------------------------------
 typedef v_uint::const_iterator v_uint_iter;
 
 template <typename Data_Type>
@@ -234,62 +241,65 @@ inline bool Tree<Data_Type>::is_dag() {
   
 }
 
+// Depth-first search through parents and offspring starting from node 0. A
+// node reached twice means there is a cycle. The search uses an explicit stack
+// (see postorder()).
 template <typename Data_Type>
-inline bool Tree<Data_Type>::is_dag_(int i, int caller, bool up_search) {
-  
-  // For the first iteration
-  if (i < 0) 
-    i = 0u, caller = -1;
-  
-  // Yes, this is not a dag (came here multiple times)
-  if (this->visited[i])
-    return false;
-  this->visited[i] = true;
-  
-  // Iterating through parents
-  for (v_uint_iter n = this->parents[i].begin(); n != this->parents[i].end(); ++n) {
+inline bool Tree<Data_Type>::is_dag_() {
+  
+  // Each frame is a node, the node it was reached from (-1 for the first one),
+  // whether it was reached going up (through a parent), and the next neighbor
+  // to check: parents first, then offspring.
+  struct Frame {uint node; int caller; bool up_search; uint next;};
+  std::vector< Frame > stack;
+  stack.reserve(this->N_NODES);
+  
+  this->visited[0u] = true;
+  stack.push_back({0u, -1, false, 0u});
+  
+  while (stack.size()) {
+    
+    Frame & f  = stack.back();
+    uint i     = f.node;
+    uint j     = f.next++;
+    uint npar  = this->parents[i].size();
+    
+    bool up;
+    uint n;
+    if (j < npar) {
+      up = true;
+      n  = this->parents[i][j];
+    } else if (j - npar < this->offspring[i].size()) {
+      up = false;
+      n  = this->offspring[i][j - npar];
+    } else {
+      stack.pop_back();
+      continue;
+    }
     
 #ifdef DEBUG_TREE
     std::printf(
-      "Tree<Data_Type>::is_dag() @ parents   (i, caller, *n, up_search): (%i, %i, %i, %i)\n",
-      i, caller, *n, up_search
+      "Tree<Data_Type>::is_dag() @ %s (i, caller, n, up_search): (%i, %i, %i, %i)\n",
+      up ? "parents  " : "offspring", i, f.caller, n, f.up_search
     );
 #endif
     
     // Checking 1:1 cycles
-    if ((int) *n == caller) {
+    if ((int) n == f.caller) {
 #ifdef DEBUG_TREE
       std::printf("\tChecking 1:1 cycles.\n");
 #endif
-      if (up_search) return false;
-      else continue; 
+      if (up == f.up_search) return false;
+      else continue;
     }
     
-    if (!(this->is_dag_((int) *n, i, true)))
+    // Yes, this is not a dag (came here multiple times)
+    if (this->visited[n])
       return false;
-  }
-  
-  // Iterating through offspring
-  for (v_uint_iter n = this->offspring[i].begin(); n != this->offspring[i].end(); ++n) {
+    this->visited[n] = true;
     
-#ifdef DEBUG_TREE
-    std::printf(
-      "Tree<Data_Type>::is_dag() @ offspring (i, caller, *n, up_search): (%i, %i, %i, %i)\n",
-      i, caller, *n, up_search
-    );
-#endif
+    stack.push_back({n, (int) i, up, 0u});
     
-    // Checking 1:1 cycles
-    if ((int) *n == caller) {
-#ifdef DEBUG_TREE
-      std::printf("\tChecking 1:1 cycles.\n");
-#endif
-      if (!up_search) return false;
-      else continue; 
-    }
-    
-    if (!(this->is_dag_((int) *n, i, false)))
-      return false;
   }
   
   return true;
@@ -306,38 +316,28 @@ inline v_uint Tree<Data_Type>::get_preorder() const {
   
 }
 
+// Number of steps from each node to the closest root, going up through the
+// parents. Same as get_dist2root, but keeping the shortest path.
 template <typename Data_Type>
-inline uint Tree<Data_Type>::get_dist_tip2root_(uint i, uint count) {
-  
-  // If we are already in a root node, then return with the reached count
-  if (parents[i].size() == 0u)
-    return count;
+inline v_uint Tree<Data_Type>::get_dist2closest_root() const {
   
-  // We start by adding one step (since we are not at the root!)
-  ++count;
+  v_uint ans(this->N_NODES, ~0u);
   
-  // Otherwise, let's see at its parents (who is closests to the root)
-  v_uint counts(parents[i].size());
-  uint j = 0;
-  for (auto iter = parents[i].begin(); iter != parents[i].end(); ++iter) {
+  // Going through the preorder (reversed POSTORDER), parents are visited
+  // before their offspring.
+  for (auto n = this->POSTORDER.rbegin(); n != this->POSTORDER.rend(); ++n) {
     
-    // Looking how far do we reach
-    counts[j] = get_dist_tip2root_(*iter, count);
+    if (parents[*n].size() == 0u)
+      ans[*n] = 0u;
     
-    // If we reached to root in the next step. Otherwise we need to keep looking
-    // until we get to that is closests.
-    if (counts[j++] == count)
-      return count;
+    for (auto o = this->offspring[*n].begin(); o != this->offspring[*n].end(); ++o)
+      if (ans[*o] > (ans[*n] + 1u))
+        ans[*o] = ans[*n] + 1u;
     
   }
   
-  // We keep the smallest one
-  count = counts[0];
-  for (auto iter = counts.begin() + 1; iter != counts.end(); ++iter)
-    if (*iter < count)
-      count = *iter;
+  return ans;
   
-  return count;
 }
 
 template <typename Data_Type>
@@ -348,8 +348,9 @@ inline v_uint Tree<Data_Type>::get_dist_tip2root() {
     // Making space available
     this->DIST_TIPS2ROOT.resize(this->n_tips());
     
+    v_uint dist = get_dist2closest_root();
     for (uint i = 0u; i < TIPS.size(); ++i)
-      DIST_TIPS2ROOT[i] = get_dist_tip2root_(TIPS[i], 0u);
+      DIST_TIPS2ROOT[i] = dist[TIPS[i]];
     
   }
   
@@ -357,6 +358,43 @@ inline v_uint Tree<Data_Type>::get_dist_tip2root() {
   
 }
 
+template <typename Data_Type>
+inline v_uint Tree<Data_Type>::get_dist2root() const {
+  
+  v_uint ans(this->N_NODES, 0u);
+  
+  // Going through the preorder (reversed POSTORDER), parents are visited
+  // before their offspring.
+  for (auto n = this->POSTORDER.rbegin(); n != this->POSTORDER.rend(); ++n)
+    for (auto o = this->offspring[*n].begin(); o != this->offspring[*n].end(); ++o)
+      if (ans[*o] < (ans[*n] + 1u))
+        ans[*o] = ans[*n] + 1u;
+  
+  return ans;
+  
+}
+
+template <typename Data_Type>
+inline const vv_uint & Tree<Data_Type>::get_levels() {
+  
+  if (this->LEVELS.size() != 0u)
+    return this->LEVELS;
+  
+  v_uint dist = this->get_dist2root();
+  
+  uint maxdist = 0u;
+  for (auto n = this->POSTORDER.begin(); n != this->POSTORDER.end(); ++n)
+    if (dist[*n] > maxdist)
+      maxdist = dist[*n];
+  
+  this->LEVELS.resize(maxdist + 1u);
+  for (auto n = this->POSTORDER.begin(); n != this->POSTORDER.end(); ++n)
+    this->LEVELS[dist[*n]].push_back(*n);
+  
+  return this->LEVELS;
+  
+}
+
 #define TOTAL(a) (a)->offspring.size()
 
 template <typename Data_Type>
@@ -364,7 +402,7 @@ inline uint Tree<Data_Type>::set_postorder(const v_uint & POSTORDER_, bool check
   
   // Checking the range of the data
   if (check) {
-    uint min_idx = 999999u, max_idx = 0u;
+    uint min_idx = ~0u, max_idx = 0u;
     for (auto i = POSTORDER_.begin(); i != POSTORDER_.end(); ++i) {
       
       if (*i > max_idx) max_idx = *i;
@@ -377,6 +415,7 @@ inline uint Tree<Data_Type>::set_postorder(const v_uint & POSTORDER_, bool check
   }
   
   this->POSTORDER = POSTORDER_;
+  this->LEVELS.clear();
   
   return 0u;
 }
@@ -422,6 +461,98 @@ inline void Tree<Data_Type>::prune_postorder(v_uint & seq) {
   
 }
 
+template <typename Data_Type>
+inline void Tree<Data_Type>::prune_postorder(Data_Type * args_) const {
+  
+  this->prune_postorder(args_, this->POSTORDER);
+  return;
+  
+}
+
+template <typename Data_Type>
+inline void Tree<Data_Type>::prune_postorder(
+    Data_Type * args_,
+    const v_uint & seq
+) const {
+  
+  if (!this->fun)
+    return;
+  
+  // The iterator only reads from the tree. As in prune_postorder_parallel,
+  // the position is kept at the end so TreeIterator::back() is the root.
+  TreeIterator<Data_Type> it(const_cast< Tree<Data_Type> * >(this));
+  it.pos_in_pruning_sequence = this->POSTORDER.size() - 1u;
+  
+  for (auto n = seq.begin(); n != seq.end(); ++n) {
+    
+    it.current_node = *n;
+    this->fun(args_, it);
+    
+  }
+  
+  return;
+  
+}
+
+template <typename Data_Type>
+inline void Tree<Data_Type>::prune_postorder_parallel(
+    int nthreads,
+    Data_Type * args_
+) {
+  
+  if (args_ == nullptr)
+    args_ = this->args;
+  
+  this->prune_postorder_parallel(nthreads, args_, this->get_levels());
+  
+  return;
+  
+}
+
+template <typename Data_Type>
+inline void Tree<Data_Type>::prune_postorder_parallel(
+    int nthreads,
+    Data_Type * args_,
+    const vv_uint & levels
+) const {
+  
+  if (nthreads < 1)
+    nthreads = 1;
+  
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) if (nthreads > 1)
+#endif
+  {
+    
+    // Each thread has its own iterator. Only the current node changes, the
+    // position in the sequence is kept at the end so TreeIterator::back()
+    // still points to the root.
+    TreeIterator<Data_Type> it(const_cast< Tree<Data_Type> * >(this));
+    it.pos_in_pruning_sequence = this->POSTORDER.size() - 1u;
+    
+    for (int l = (int) levels.size() - 1; l >= 0; --l) {
+      
+      const v_uint & level = levels[l];
+      
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for (int i = 0; i < (int) level.size(); ++i) {
+        
+        it.current_node = level[i];
+        if (this->fun)
+          this->fun(args_, it);
+        
+      }
+      
+    }
+    
+  }
+  
+  return;
+  
+}
+
 template <typename Data_Type>
 inline void Tree<Data_Type>::prune_preorder() {
   
@@ -467,8 +598,8 @@ template <typename Data_Type>
 inline uint Tree<Data_Type>::n_tips() const {
   
   uint count = 0u;
-  for (auto i = this->offspring.begin(); i != offspring.end(); ++i)
-    if (i->size() == 0u)
+  for (uint i = 0u; i < this->offspring.size(); ++i)
+    if (this->offspring[i].size() == 0u)
       ++count;
   
   return count;
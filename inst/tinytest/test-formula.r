@@ -43,3 +43,28 @@ expect_warning(
 expect_identical(class(ans), "aphylo_estimates")
   
 # aphylo_formula(x ~ psi + mu_d + mu_s + eta)$fun
+
+# Compiled objective function --------------------------------------------------
+set.seed(8812)
+x <- rdrop_annotations(raphylo(60, P = 2), .3)
+y <- c(x, rdrop_annotations(raphylo(30, P = 2), .3))
+
+for (fm in list(x ~ mu_d, x ~ psi + mu_d + mu_s + eta + Pi, y ~ psi + mu_d)) {
+  
+  m <- aphylo_formula(fm)
+  d <- new_aphylo_pruner(m$dat)
+  
+  for (pr in list(uprior(), bprior(2, 9), bprior(c(2, 3), 9))) {
+    f <- aphylo:::aphylo_compile(m, pr, d)
+    expect_equal(
+      f(m$params, dat = d, priors = pr),
+      m$fun(m$params, dat = d, priors = pr)
+    )
+  }
+  
+}
+
+# Other priors can't be compiled
+pr <- function(p) dbeta(p, 2, 2)
+expect_identical(aphylo:::aphylo_compile(m, pr, d), m$fun)
+expect_identical(aphylo:::aphylo_compile(m, bprior(2, 9, log = FALSE), d), m$fun)
@@ -398,3 +398,483 @@ ans2 <- LogLike(
 
 expect_equal(ans0$ll, ans2$ll)
 
+
+# Factorized kernel ------------------------------------------------------------
+set.seed(5512)
+x <- raphylo(60, P = 3)
+x_pruner <- new_aphylo_pruner(x)
+
+ans0 <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  factorized = FALSE
+  )
+ans1 <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  factorized = TRUE
+  )
+
+expect_equal(ans0$ll, ans1$ll)
+expect_equal(ans0$Pr[[1]], ans1$Pr[[1]])
+
+# Large enough for the tabulated transitions to go through BLAS
+x7 <- new_aphylo_pruner(raphylo(40, P = 7))
+ans_fz <- sapply(c(FALSE, TRUE, FALSE), function(fz) {
+  aphylo:::.LogLike_pruner(
+    x7, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+    factorized = fz, verb = FALSE
+    )$ll
+})
+
+expect_equal(ans_fz[1], ans_fz[2])
+expect_identical(ans_fz[1], ans_fz[3])
+
+# Scaling ----------------------------------------------------------------------
+# Small trees: all scaling methods should give the same answer
+ans_none <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  scaling = "none", verb = FALSE
+  )
+ans_log  <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  scaling = "log", verb = FALSE
+  )
+
+expect_identical(ans0$ll, ans_none$ll)
+expect_equal(ans0$ll, ans_log$ll)
+
+# Large trees shouldn't underflow
+set.seed(1)
+x <- raphylo(5000)
+x_pruner <- new_aphylo_pruner(x)
+
+ans_none <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  scaling = "none", verb = FALSE
+)
+ans_rescale <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  scaling = "rescale", verb = FALSE
+)
+ans_log <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  scaling = "log", verb = FALSE
+)
+
+expect_equal(ans_none$ll, -Inf)
+expect_true(is.finite(ans_rescale$ll))
+expect_equal(ans_rescale$ll, ans_log$ll)
+
+# Parallel (level-synchronous) pruning -----------------------------------------
+ans_par <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  scaling = "rescale", verb = FALSE, nthreads = 2L
+)
+
+expect_equal(ans_rescale$ll, ans_par$ll)
+
+# Batched evaluation -----------------------------------------------------------
+set.seed(7712)
+x <- raphylo(200, P = 2)
+x_pruner <- new_aphylo_pruner(x)
+
+pars <- rbind(
+  c(psi, mu, rev(mu), eta, Pi),
+  c(psi, rev(mu), mu, eta, -1),
+  c(rev(psi), mu, mu, -1, -1, Pi)
+)
+
+for (fz in c(FALSE, TRUE)) {
+  
+  ans_batch <- aphylo:::.LogLike_pruner_batch(x_pruner, pars, factorized = fz)
+  ans_loop  <- apply(pars, 1, function(p) {
+    aphylo:::.LogLike_pruner(
+      x_pruner, psi = p[1:2], mu_d = p[3:4], mu_s = p[5:6], eta = p[7:8],
+      Pi = p[9], verb = FALSE, factorized = fz
+    )$ll
+  })
+  
+  expect_equal(ans_batch, ans_loop)
+  
+}
+
+expect_error(aphylo:::.LogLike_pruner_batch(x_pruner, pars[, -1]), "columns")
+expect_error(
+  aphylo:::.LogLike_pruner_batch(x_pruner, pars, scaling = "log"), "rescale"
+  )
+
+# Analytic gradient ------------------------------------------------------------
+set.seed(8812)
+x <- raphylo(100, P = 2)
+x_pruner <- new_aphylo_pruner(x)
+
+ll_fun <- function(p, Pi_ = p[9]) {
+  aphylo:::.LogLike_pruner(
+    x_pruner, psi = p[1:2], mu_d = p[3:4], mu_s = p[5:6], eta = p[7:8],
+    Pi = Pi_, verb = FALSE
+  )$ll
+}
+
+num_grad <- function(p, ...) {
+  sapply(seq_along(p), function(i) {
+    h <- 1e-6
+    p_up <- p_lo <- p
+    p_up[i] <- p_up[i] + h
+    p_lo[i] <- p_lo[i] - h
+    (ll_fun(p_up, ...) - ll_fun(p_lo, ...)) / (2 * h)
+  })
+}
+
+p0 <- c(psi, mu, rev(mu), eta, Pi)
+ans <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = p0[1:2], mu_d = p0[3:4], mu_s = p0[5:6], eta = p0[7:8],
+  Pi = p0[9], verb = FALSE, gradient = TRUE
+)
+
+expect_equal(unname(ans$gradient), num_grad(p0), tolerance = 1e-5)
+
+# Stationary Pi: the derivative goes into the mus
+ans <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = p0[1:2], mu_d = p0[3:4], mu_s = p0[5:6], eta = p0[7:8],
+  Pi = -1, verb = FALSE, gradient = TRUE
+)
+
+expect_equal(
+  unname(ans$gradient[1:8]), num_grad(p0, Pi_ = -1)[1:8], tolerance = 1e-5
+  )
+expect_equal(unname(ans$gradient[9]), 0)
+
+# Same for the model function
+model <- aphylo:::aphylo_formula(x ~ psi + mu_d + eta + Pi, env = environment())
+expect_equal(
+  model$gr(model$params, dat = x_pruner, priors = function(p) 1),
+  sapply(seq_along(model$params), function(i) {
+    h <- 1e-6
+    p_up <- p_lo <- model$params
+    p_up[i] <- p_up[i] + h
+    p_lo[i] <- p_lo[i] - h
+    (model$fun(p_up, x_pruner, function(p) 1) -
+        model$fun(p_lo, x_pruner, function(p) 1)) / (2 * h)
+  }),
+  tolerance = 1e-5, check.attributes = FALSE
+)
+
+# The gradient of beta priors is exact
+p_in   <- model$params
+p_in[] <- .2
+expect_equal(
+  model$gr(p_in, dat = x_pruner, priors = bprior(2, 9)) -
+    model$gr(p_in, dat = x_pruner, priors = uprior()),
+  (2 - 1) / p_in - (9 - 1) / (1 - p_in)
+)
+
+# A parameter outside of [0, 1] doesn't drop the gradient of the others
+p_out    <- p_in
+p_out[1] <- -1e-3
+gr_out   <- model$gr(p_out, dat = x_pruner, priors = bprior(2, 9))
+expect_equivalent(gr_out[1], 0)
+expect_true(all(gr_out[-1] != 0))
+
+# Incremental updates after changing annotations -------------------------------
+set.seed(1231)
+x <- raphylo(300, P = 2)
+x_pruner <- new_aphylo_pruner(x)
+
+ll_x <- function(tree) {
+  aphylo:::.LogLike_pruner(
+    tree, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+    verb = TRUE
+  )
+}
+
+ans0 <- ll_x(x_pruner)
+for (i in c(3, 50, 120)) {
+  
+  # Only the path to the root is updated
+  aphylo:::Tree_set_ann(x_pruner, i - 1L, 1L, 9L)
+  x$tip.annotation[i, 2] <- 9L
+  
+  expect_identical(ll_x(x_pruner), ll_x(new_aphylo_pruner(x)))
+  
+}
+
+# Pr is returned without copying, but later calls don't modify it --------------
+x_pruner <- new_aphylo_pruner(x)
+
+ans0 <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi
+  )
+Pr0  <- ans0$Pr[[1]][, , drop = FALSE]
+ans1 <- aphylo:::.LogLike_pruner(
+  x_pruner, psi = psi, mu_d = rev(mu), mu_s = mu, eta = eta, Pi = Pi
+  )
+
+expect_identical(ans0$Pr[[1]], Pr0)
+expect_equal(dim(ans0$Pr[[1]]), c(Nnode(x, internal.only = FALSE), 4L))
+expect_false(isTRUE(all.equal(ans0$Pr[[1]], ans1$Pr[[1]])))
+
+# Deep (caterpillar) trees don't overflow the stack ----------------------------
+x <- new_aphylo(
+  tip.annotation = matrix(rep(c(0L, 1L), 10000L)),
+  tree           = ape::stree(20000L, type = "left")
+  )
+x_pruner <- new_aphylo_pruner(x)
+
+expect_equal(length(aphylo:::Tree_get_postorder(x_pruner)), 39999L)
+expect_true(is.finite(
+  LogLike(
+    x_pruner, psi = psi, mu_d = mu, mu_s = mu, eta = eta, Pi = Pi,
+    verb_ans = FALSE
+  )$ll
+))
+
+# Memory budget ----------------------------------------------------------------
+set.seed(8812)
+x   <- rdrop_annotations(raphylo(200), .5)
+ll0 <- LogLike(x, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi)
+
+# The full matrix (399 x 2 doubles) doesn't fit, so only the nodes in the
+# pruning sequence are stored
+op  <- options(aphylo_max_memory = 6000 / 2^30)
+ll1 <- LogLike(x, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi)
+
+options(aphylo_max_memory = 100 / 2^30)
+expect_error(new_aphylo_pruner(x), "memory budget")
+options(op)
+
+expect_equal(ll0, ll1)
+
+# The same goes for the gradient and the batches
+pars    <- rbind(c(psi, mu, rev(mu), -1, -1, Pi))
+ll_grad <- function(tree) {
+  aphylo:::.LogLike_pruner(
+    tree, psi = psi, mu_d = mu, mu_s = rev(mu), eta = c(-1, -1), Pi = Pi,
+    verb = FALSE, gradient = TRUE
+  )$gradient
+}
+
+x_pruner <- new_aphylo_pruner(x)
+grad0    <- ll_grad(x_pruner)
+batch0   <- aphylo:::.LogLike_pruner_batch(x_pruner, pars)
+
+op       <- options(aphylo_max_memory = 6000 / 2^30)
+x_pruner <- new_aphylo_pruner(x)
+grad1    <- ll_grad(x_pruner)
+batch1   <- aphylo:::.LogLike_pruner_batch(x_pruner, pars)
+expect_error(
+  aphylo:::.LogLike_pruner_batch(x_pruner, pars[rep(1, 100), , drop = FALSE]),
+  "memory budget"
+  )
+options(op)
+
+expect_equal(grad0, grad1)
+expect_equal(batch0, batch1)
+
+# Pool of trees ----------------------------------------------------------------
+set.seed(7712)
+x <- c(rdrop_annotations(raphylo(100), .5), raphylo(20), raphylo(50))
+x_pruner <- new_aphylo_pruner(x)
+
+ll_trees <- sapply(x_pruner, function(p) {
+  LogLike(p, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi)$ll
+})
+
+op <- options(aphylo_nthreads = 1L)
+ll_pool1 <- LogLike(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  verb_ans = FALSE
+  )$ll
+options(aphylo_nthreads = 2L)
+ll_pool2 <- LogLike(
+  x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  verb_ans = FALSE
+  )$ll
+options(op)
+
+expect_equal(ll_pool1, sum(ll_trees))
+expect_identical(ll_pool1, ll_pool2)
+
+# Replacing a tree doesn't use the trees of the old pool
+x_pruner[[1]] <- new_aphylo_pruner(raphylo(30))
+ll_trees[1]   <- LogLike(
+  x_pruner[[1]], psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi
+  )$ll
+
+expect_equal(
+  LogLike(
+    x_pruner, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+    verb_ans = FALSE
+    )$ll,
+  sum(ll_trees)
+  )
+
+# Joint log-posterior of the hierarchical model --------------------------------
+set.seed(8812)
+x       <- rmultiAphylo(6, 30, P = 2)
+classes <- c(3, 1, 3, 1, 1, 3)
+pnames  <- c("psi0", "psi1", "mu_d0", "mu_d1", "Pi")
+par <- c(
+  structure(c(.1, .05, .3, .2, .4), names = sprintf("%s_class001", pnames)),
+  structure(c(.05, .1, .2, .3, .6), names = sprintf("%s_class003", pnames)),
+  structure(2:6, names = sprintf("alpha_%s", pnames)),
+  structure(9:5, names = sprintf("beta_%s", pnames))
+)
+
+ptrs <- lapply(x, new_aphylo_pruner)
+ans_r <- sum(sapply(seq_along(x), function(i) {
+  
+  p <- par[sprintf("%s_class%03i", pnames, classes[i])]
+  LogLike(
+    ptrs[[i]], psi = p[1:2], mu_d = p[3:4], mu_s = p[3:4], eta = c(-1, -1),
+    Pi = p[5]
+    )$ll + sum(dbeta(
+      p, par[sprintf("alpha_%s", pnames)], par[sprintf("beta_%s", pnames)],
+      log = TRUE
+      ))
+  
+}))
+
+hier_ptr <- aphylo:::new_aphylo_hier_ptr(ptrs, classes, pnames, names(par))
+expect_equal(aphylo:::.aphylo_hier_eval(hier_ptr, par), ans_r)
+
+# Same with multiple threads
+op <- options(aphylo_nthreads = 2L)
+hier_ptr <- aphylo:::new_aphylo_hier_ptr(ptrs, classes, pnames, names(par))
+expect_equal(aphylo:::.aphylo_hier_eval(hier_ptr, par), ans_r)
+options(op)
+
+# Identical trees are evaluated once -------------------------------------------
+set.seed(4431)
+x1 <- raphylo(30)
+x2 <- raphylo(30)
+xs <- new_aphylo_pruner(c(x1, x2, x1, x1, x2))
+
+ans_pool <- LogLike(
+  xs, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  verb_ans = FALSE
+  )$ll
+ans_each <- sapply(xs, function(x.) {
+  LogLike(
+    x., psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+    verb_ans = FALSE
+    )$ll
+})
+
+expect_equal(ans_pool, sum(ans_each))
+expect_equal(ans_each[c(1, 1, 2)], ans_each[c(3, 4, 5)])
+
+# Repeated columns are evaluated once (the model factorizes across functions)
+x3 <- rdrop_annotations(raphylo(40, P = 2), .3)
+x3 <- new_aphylo(
+  tree            = x3$tree,
+  tip.annotation  = x3$tip.annotation[, c(1, 2, 1, 1)],
+  node.annotation = x3$node.annotation[, c(1, 2, 1, 1)],
+  tip.type        = x3$tip.type,
+  node.type       = x3$node.type
+)
+xs <- new_aphylo_pruner(c(x3, x1))
+
+ans_pool <- LogLike(
+  xs, psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+  verb_ans = FALSE
+  )$ll
+ans_each <- sapply(xs, function(x.) {
+  LogLike(
+    x., psi = psi, mu_d = mu, mu_s = rev(mu), eta = eta, Pi = Pi,
+    verb_ans = FALSE
+    )$ll
+})
+
+expect_equal(ans_pool, sum(ans_each))
+
+y <- c(x3, x1)
+m <- aphylo_formula(y ~ psi + mu_d + mu_s + eta + Pi)
+d <- new_aphylo_pruner(m$dat)
+f <- aphylo:::aphylo_compile(m, uprior(), d)
+expect_equal(
+  f(m$params, dat = d, priors = uprior()),
+  m$fun(m$params, dat = d, priors = uprior())
+)
+
+# Changing one parameter at a time only updates the nodes that depend on it ----
+set.seed(7123)
+x   <- raphylo(80, P = 2)
+ptr <- new_aphylo_pruner(x)
+args <- list(
+  psi = c(.1, .05), mu_d = c(.3, .2), mu_s = c(.1, .05), eta = c(.8, .9),
+  Pi = .4
+)
+do.call(LogLike, c(list(ptr, verb_ans = FALSE), args))
+
+changes <- list(
+  Pi = .2, mu_d = c(.35, .2), mu_s = c(.1, .1), psi = c(.05, .05),
+  eta = c(.7, .9)
+)
+
+for (p in names(changes)) {
+  
+  args[[p]] <- changes[[p]]
+  
+  ans0 <- do.call(LogLike, c(list(ptr, verb_ans = FALSE), args))$ll
+  ans1 <- do.call(
+    LogLike, c(list(new_aphylo_pruner(x), verb_ans = FALSE), args)
+    )$ll
+  
+  expect_equal(ans0, ans1, info = p)
+  
+}
+
+# Reduced and full pruning sequences give the same likelihood -----------------
+set.seed(1871)
+x   <- rdrop_annotations(raphylo(60), .5)
+ptr <- new_aphylo_pruner(x)
+args <- list(
+  psi = c(.1, .05), mu_d = c(.3, .2), mu_s = c(.1, .05), eta = c(-1, -1),
+  Pi = .4
+)
+
+ans_reduced <- do.call(LogLike, c(list(ptr, verb_ans = FALSE), args))$ll
+op <- options(aphylo_reduce_pseq = FALSE)
+ans_full <- do.call(LogLike, c(list(ptr, verb_ans = FALSE), args))$ll
+options(op)
+
+expect_equal(ans_reduced, ans_full)
+
+# Annotating a tip that had no annotations updates the reduced sequence
+i <- which(x$tip.annotation[, 1] == 9L)[1]
+aphylo:::Tree_set_ann(ptr, i - 1L, 0L, 1L)
+x$tip.annotation[i, 1] <- 1L
+
+expect_equal(
+  do.call(LogLike, c(list(ptr, verb_ans = FALSE), args))$ll,
+  do.call(LogLike, c(list(new_aphylo_pruner(x), verb_ans = FALSE), args))$ll
+)
+
+# Leaving one tip out only prunes its path to the root, even when the tip drops
+# out of (and back into) the reduced sequence
+ptr <- new_aphylo_pruner(x)
+do.call(LogLike, c(list(ptr, verb_ans = FALSE), args))
+
+for (i in which(x$tip.annotation[, 1] != 9L)[1:5]) {
+  
+  path <- length(ape::nodepath(x$tree, Ntip(x) + 1L, i))
+  ann  <- x$tip.annotation[i, 1]
+  
+  aphylo:::Tree_set_ann(ptr, i - 1L, 0L, 9L)
+  x$tip.annotation[i, 1] <- 9L
+  
+  expect_equal(
+    do.call(LogLike, c(list(ptr, verb_ans = FALSE), args))$ll,
+    do.call(LogLike, c(list(new_aphylo_pruner(x), verb_ans = FALSE), args))$ll
+  )
+  expect_equal(aphylo:::Tree_get_nupdated(ptr), path)
+  
+  aphylo:::Tree_set_ann(ptr, i - 1L, 0L, ann)
+  x$tip.annotation[i, 1] <- ann
+  
+  expect_equal(
+    do.call(LogLike, c(list(ptr, verb_ans = FALSE), args))$ll,
+    do.call(LogLike, c(list(new_aphylo_pruner(x), verb_ans = FALSE), args))$ll
+  )
+  expect_equal(aphylo:::Tree_get_nupdated(ptr), path)
+  
+}
@@ -150,3 +150,58 @@ expect_true(all(abs(unname(coef(ans2)) - rep(2/22, 5)) < .025))
   
   
 # })
+
+# Native sampler ---------------------------------------------------------------
+set.seed(6612)
+x    <- rdrop_annotations(raphylo(100), .2)
+ctrl <- list(nsteps = 5e3, burnin = 1e3, thin = 10, nchains = 2, native = TRUE)
+
+set.seed(1); ans_native <- suppressWarnings(
+  aphylo_mcmc(x ~ mu_d + psi + Pi, priors = bprior(), control = ctrl)
+  )
+set.seed(1); ans_native_pll <- suppressWarnings(
+  aphylo_mcmc(
+    x ~ mu_d + psi + Pi, priors = bprior(),
+    control = c(ctrl, list(multicore = TRUE))
+    )
+  )
+ans_fmcmc <- suppressWarnings(
+  aphylo_mcmc(
+    x ~ mu_d + psi + Pi, priors = bprior(),
+    control = list(nsteps = 5e3, burnin = 1e3, thin = 10, nchains = 2)
+    )
+  )
+
+expect_equal(coda::nchain(ans_native$hist), 2L)
+expect_equal(coda::niter(ans_native$hist), 400L)
+expect_equal(colnames(ans_native$hist[[1]]), names(coef(ans_fmcmc)))
+
+# Each chain has its own seed, so threads don't change the results
+expect_identical(ans_native$hist, ans_native_pll$hist)
+expect_equivalent(coef(ans_native), coef(ans_fmcmc), tol = .1, scale = 1)
+
+expect_error(
+  aphylo_mcmc(
+    x ~ mu_d + psi + Pi, priors = function(p) dbeta(p, 1, 9), control = ctrl
+    ),
+  "native sampler"
+  )
+
+# Forked chains after using multiple threads in the master ---------------------
+if (.Platform$OS.type == "unix") {
+  
+  op <- options(aphylo_nthreads = 2L)
+  ans_fork <- suppressWarnings(
+    aphylo_mcmc(
+      x ~ mu_d + psi + Pi, priors = bprior(),
+      control = list(
+        nsteps = 5e3, burnin = 1e3, thin = 10, nchains = 2, multicore = TRUE
+        )
+      )
+    )
+  options(op)
+  
+  expect_equal(coda::nchain(ans_fork$hist), 2L)
+  expect_equivalent(coef(ans_fork), coef(ans_fmcmc), tol = .1, scale = 1)
+  
+}
@@ -190,3 +190,99 @@ expect_equal(
   lapply(pred0, "[", -c(1:5)),
   lapply(pred1, "[", -c(1:5))
 )
+
+# Native leave-one-out ---------------------------------------------------------
+set.seed(7123)
+x   <- rdrop_annotations(raphylo(40, P = 2), .3)
+ans <- suppressWarnings(
+  aphylo_mle(x ~ psi + mu_d + mu_s + Pi)
+  )
+
+pred_loo <- predict(ans, ids = list(1:Nnode(x, internal.only = FALSE)))
+
+# Leave-one-out by hand: dropping one annotation at a time
+par  <- coef(ans)
+expected <- matrix(NA_real_, nrow = nrow(pred_loo), ncol = Nann(x))
+for (j in 1:Nann(x)) {
+  
+  x_j <- x[, j]
+  x_j_pruner <- new_aphylo_pruner(x_j)
+  
+  for (i in 1:Ntip(x)) {
+    
+    aphylo:::Tree_set_ann(x_j_pruner, i - 1L, 0L, 9L)
+    expected[i, j] <- aphylo:::.posterior_prob(
+      x_j_pruner,
+      mu_d = par[c("mu_d0", "mu_d1")],
+      mu_s = par[c("mu_s0", "mu_s1")],
+      psi  = par[c("psi0", "psi1")],
+      eta  = c(-1, -1),
+      Pi   = par["Pi"]
+      )$posterior[i]
+    aphylo:::Tree_set_ann(x_j_pruner, i - 1L, 0L, x$tip.annotation[i, j])
+    
+  }
+  
+}
+
+expect_equivalent(pred_loo[1:Ntip(x), ], expected[1:Ntip(x), ])
+
+# Interior nodes use all the data
+pred_all <- predict(
+  ans, ids = list(1:Nnode(x, internal.only = FALSE)), loo = FALSE
+  )
+expect_equivalent(pred_loo[-(1:Ntip(x)), ], pred_all[-(1:Ntip(x)), ])
+
+# With eta, the unannotated tips are also part of the likelihood
+par_eta <- c(par, eta0 = .7, eta1 = .9)
+pred_loo_eta <- predict(
+  ans, ids = list(1:Nnode(x, internal.only = FALSE)), params = par_eta
+  )
+pred_all_eta <- predict(
+  ans, ids = list(1:Nnode(x, internal.only = FALSE)), params = par_eta,
+  loo = FALSE
+  )
+
+expected_eta <- matrix(NA_real_, nrow = Ntip(x), ncol = Nann(x))
+for (j in 1:Nann(x)) {
+  
+  x_j_pruner <- new_aphylo_pruner(x[, j])
+  
+  for (i in 1:Ntip(x)) {
+    
+    aphylo:::Tree_set_ann(x_j_pruner, i - 1L, 0L, 9L)
+    expected_eta[i, j] <- aphylo:::.posterior_prob(
+      x_j_pruner,
+      mu_d = par[c("mu_d0", "mu_d1")],
+      mu_s = par[c("mu_s0", "mu_s1")],
+      psi  = par[c("psi0", "psi1")],
+      eta  = par_eta[c("eta0", "eta1")],
+      Pi   = par["Pi"]
+      )$posterior[i]
+    aphylo:::Tree_set_ann(x_j_pruner, i - 1L, 0L, x$tip.annotation[i, j])
+    
+  }
+  
+}
+
+expect_equivalent(pred_loo_eta[1:Ntip(x), ], expected_eta)
+expect_equivalent(pred_loo_eta[-(1:Ntip(x)), ], pred_all_eta[-(1:Ntip(x)), ])
+expect_true(
+  any(abs(pred_all_eta[-(1:Ntip(x)), ] - pred_all[-(1:Ntip(x)), ]) > 1e-5)
+  )
+
+# Joint posterior of multiple functions ----------------------------------------
+set.seed(3312)
+x <- rdrop_annotations(raphylo(50, P = 3), .2)
+
+pred_joint <- predict_pre_order(
+  x, psi = psi, mu_d = mu, mu_s = rev(mu), eta = c(-1, -1), Pi = Pi
+  )
+pred_cols  <- sapply(1:Nann(x), function(j) {
+  predict_pre_order(
+    x[, j], psi = psi, mu_d = mu, mu_s = rev(mu), eta = c(-1, -1), Pi = Pi
+    )
+})
+
+expect_equal(dim(pred_joint), c(Nnode(x, internal.only = FALSE), Nann(x)))
+expect_equivalent(pred_joint, pred_cols)
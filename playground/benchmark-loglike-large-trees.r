@@ -0,0 +1,74 @@
+# Micro benchmark of .LogLike_pruner on large trees (10k to 50k nodes).
+#
+# The likelihood is memory bound on large trees, so the best way to see the
+# effect of the storage layout of TreeData (e.g., flat Pr vs vector of
+# vectors) is to compare two installed versions of the package and look at
+# both time and cache misses. For example:
+#
+#   R CMD INSTALL --library=lib-old aphylo_old.tar.gz
+#   R CMD INSTALL --library=lib-new aphylo_new.tar.gz
+#   perf stat -e cache-references,cache-misses \
+#     Rscript playground/benchmark-loglike-large-trees.r lib-old
+#   perf stat -e cache-references,cache-misses \
+#     Rscript playground/benchmark-loglike-large-trees.r lib-new
+#
+# Without arguments the script uses the default library.
+
+args <- commandArgs(trailingOnly = TRUE)
+lib  <- if (length(args)) args[1] else NULL
+
+library(aphylo, lib.loc = lib)
+library(microbenchmark)
+
+set.seed(1231)
+
+# Number of tips so that the trees have (roughly) 10k, 25k, and 50k nodes
+ntips <- c(5000L, 12500L, 25000L)
+nfuns <- c(1L, 2L, 3L)
+
+# The pruner keeps the probabilities of the nodes between calls, so repeating
+# the same parameters would only time the cache. Alternating between two sets
+# (psi included, on which all the tips depend) prunes the full tree every call.
+params <- list(
+  list(mu_d = c(.3, .1), mu_s = c(.05, .02), psi = c(.1, .05)),
+  list(mu_d = c(.25, .15), mu_s = c(.04, .03), psi = c(.08, .06))
+)
+eta  <- c(.9, .8)
+Pi   <- .4
+
+ans <- NULL
+for (n in ntips) {
+  for (P in nfuns) {
+
+    x <- rdrop_annotations(raphylo(n, P = P), .5)
+    x_pruner <- new_aphylo_pruner(x)
+
+    k  <- 0L
+    bm <- microbenchmark(
+      LogLike = {
+        k <- k + 1L
+        p <- params[[k %% 2L + 1L]]
+        aphylo:::.LogLike_pruner(
+          x_pruner, mu_d = p$mu_d, mu_s = p$mu_s, psi = p$psi, eta = eta,
+          Pi = Pi, verb = FALSE
+        )
+      },
+      times = 50L
+    )
+
+    ans <- rbind(
+      ans,
+      data.frame(
+        nodes  = Nnode(x, internal.only = FALSE),
+        P      = P,
+        median = stats::median(bm$time)/1e6,
+        mean   = mean(bm$time)/1e6
+      )
+    )
+
+  }
+}
+
+cat(sprintf("Library: %s\n", if (is.null(lib)) "(default)" else lib))
+cat("Time per evaluation (milliseconds)\n")
+print(ans)
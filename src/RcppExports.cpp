@@ -11,15 +11,16 @@ Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
 // new_aphylo_pruner_cpp
-SEXP new_aphylo_pruner_cpp(const std::vector< std::vector< unsigned int > >& edgelist, const std::vector< std::vector< unsigned int > >& A, const std::vector< unsigned int >& types, unsigned int nannotated);
-RcppExport SEXP _aphylo_new_aphylo_pruner_cpp(SEXP edgelistSEXP, SEXP ASEXP, SEXP typesSEXP, SEXP nannotatedSEXP) {
+SEXP new_aphylo_pruner_cpp(const std::vector< std::vector< unsigned int > >& edgelist, const std::vector< std::vector< unsigned int > >& A, const std::vector< unsigned int >& types, unsigned int nannotated, double max_memory);
+RcppExport SEXP _aphylo_new_aphylo_pruner_cpp(SEXP edgelistSEXP, SEXP ASEXP, SEXP typesSEXP, SEXP nannotatedSEXP, SEXP max_memorySEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::traits::input_parameter< const std::vector< std::vector< unsigned int > >& >::type edgelist(edgelistSEXP);
     Rcpp::traits::input_parameter< const std::vector< std::vector< unsigned int > >& >::type A(ASEXP);
     Rcpp::traits::input_parameter< const std::vector< unsigned int >& >::type types(typesSEXP);
     Rcpp::traits::input_parameter< unsigned int >::type nannotated(nannotatedSEXP);
-    rcpp_result_gen = Rcpp::wrap(new_aphylo_pruner_cpp(edgelist, A, types, nannotated));
+    Rcpp::traits::input_parameter< double >::type max_memory(max_memorySEXP);
+    rcpp_result_gen = Rcpp::wrap(new_aphylo_pruner_cpp(edgelist, A, types, nannotated, max_memory));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -35,8 +36,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // LogLike_pruner
-List LogLike_pruner(SEXP tree_ptr, const std::vector< double >& mu_d, const std::vector< double >& mu_s, const std::vector< double >& psi, const std::vector< double >& eta, const double& Pi, bool verb, bool check_dims);
-RcppExport SEXP _aphylo_LogLike_pruner(SEXP tree_ptrSEXP, SEXP mu_dSEXP, SEXP mu_sSEXP, SEXP psiSEXP, SEXP etaSEXP, SEXP PiSEXP, SEXP verbSEXP, SEXP check_dimsSEXP) {
+List LogLike_pruner(SEXP tree_ptr, const std::vector< double >& mu_d, const std::vector< double >& mu_s, const std::vector< double >& psi, const std::vector< double >& eta, const double& Pi, bool verb, bool check_dims, bool factorized, std::string scaling, int nthreads, bool gradient, bool reduced_pseq);
+RcppExport SEXP _aphylo_LogLike_pruner(SEXP tree_ptrSEXP, SEXP mu_dSEXP, SEXP mu_sSEXP, SEXP psiSEXP, SEXP etaSEXP, SEXP PiSEXP, SEXP verbSEXP, SEXP check_dimsSEXP, SEXP factorizedSEXP, SEXP scalingSEXP, SEXP nthreadsSEXP, SEXP gradientSEXP, SEXP reduced_pseqSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::traits::input_parameter< SEXP >::type tree_ptr(tree_ptrSEXP);
@@ -47,7 +48,126 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const double& >::type Pi(PiSEXP);
     Rcpp::traits::input_parameter< bool >::type verb(verbSEXP);
     Rcpp::traits::input_parameter< bool >::type check_dims(check_dimsSEXP);
-    rcpp_result_gen = Rcpp::wrap(LogLike_pruner(tree_ptr, mu_d, mu_s, psi, eta, Pi, verb, check_dims));
+    Rcpp::traits::input_parameter< bool >::type factorized(factorizedSEXP);
+    Rcpp::traits::input_parameter< std::string >::type scaling(scalingSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type gradient(gradientSEXP);
+    Rcpp::traits::input_parameter< bool >::type reduced_pseq(reduced_pseqSEXP);
+    rcpp_result_gen = Rcpp::wrap(LogLike_pruner(tree_ptr, mu_d, mu_s, psi, eta, Pi, verb, check_dims, factorized, scaling, nthreads, gradient, reduced_pseq));
+    return rcpp_result_gen;
+END_RCPP
+}
+// new_aphylo_pruner_pool
+SEXP new_aphylo_pruner_pool(const List& trees);
+RcppExport SEXP _aphylo_new_aphylo_pruner_pool(SEXP treesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< const List& >::type trees(treesSEXP);
+    rcpp_result_gen = Rcpp::wrap(new_aphylo_pruner_pool(trees));
+    return rcpp_result_gen;
+END_RCPP
+}
+// aphylo_pruner_pool_valid
+bool aphylo_pruner_pool_valid(SEXP pool_ptr, const List& trees);
+RcppExport SEXP _aphylo_aphylo_pruner_pool_valid(SEXP pool_ptrSEXP, SEXP treesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type pool_ptr(pool_ptrSEXP);
+    Rcpp::traits::input_parameter< const List& >::type trees(treesSEXP);
+    rcpp_result_gen = Rcpp::wrap(aphylo_pruner_pool_valid(pool_ptr, trees));
+    return rcpp_result_gen;
+END_RCPP
+}
+// LogLike_pruner_pool
+double LogLike_pruner_pool(SEXP pool_ptr, const std::vector< double >& mu_d, const std::vector< double >& mu_s, const std::vector< double >& psi, const std::vector< double >& eta, const double& Pi, bool factorized, std::string scaling, int nthreads, bool reduced_pseq);
+RcppExport SEXP _aphylo_LogLike_pruner_pool(SEXP pool_ptrSEXP, SEXP mu_dSEXP, SEXP mu_sSEXP, SEXP psiSEXP, SEXP etaSEXP, SEXP PiSEXP, SEXP factorizedSEXP, SEXP scalingSEXP, SEXP nthreadsSEXP, SEXP reduced_pseqSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type pool_ptr(pool_ptrSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type mu_d(mu_dSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type mu_s(mu_sSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type psi(psiSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< const double& >::type Pi(PiSEXP);
+    Rcpp::traits::input_parameter< bool >::type factorized(factorizedSEXP);
+    Rcpp::traits::input_parameter< std::string >::type scaling(scalingSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type reduced_pseq(reduced_pseqSEXP);
+    rcpp_result_gen = Rcpp::wrap(LogLike_pruner_pool(pool_ptr, mu_d, mu_s, psi, eta, Pi, factorized, scaling, nthreads, reduced_pseq));
+    return rcpp_result_gen;
+END_RCPP
+}
+// new_aphylo_model
+SEXP new_aphylo_model(const List& trees, const std::vector< std::string >& par_names, const std::vector< double >& shape1, const std::vector< double >& shape2, bool uniform, bool factorized, std::string scaling, int nthreads, bool reduced_pseq);
+RcppExport SEXP _aphylo_new_aphylo_model(SEXP treesSEXP, SEXP par_namesSEXP, SEXP shape1SEXP, SEXP shape2SEXP, SEXP uniformSEXP, SEXP factorizedSEXP, SEXP scalingSEXP, SEXP nthreadsSEXP, SEXP reduced_pseqSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< const List& >::type trees(treesSEXP);
+    Rcpp::traits::input_parameter< const std::vector< std::string >& >::type par_names(par_namesSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type shape1(shape1SEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type shape2(shape2SEXP);
+    Rcpp::traits::input_parameter< bool >::type uniform(uniformSEXP);
+    Rcpp::traits::input_parameter< bool >::type factorized(factorizedSEXP);
+    Rcpp::traits::input_parameter< std::string >::type scaling(scalingSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type reduced_pseq(reduced_pseqSEXP);
+    rcpp_result_gen = Rcpp::wrap(new_aphylo_model(trees, par_names, shape1, shape2, uniform, factorized, scaling, nthreads, reduced_pseq));
+    return rcpp_result_gen;
+END_RCPP
+}
+// aphylo_model_eval
+double aphylo_model_eval(SEXP model_ptr, const std::vector< double >& p);
+RcppExport SEXP _aphylo_aphylo_model_eval(SEXP model_ptrSEXP, SEXP pSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model_ptr(model_ptrSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type p(pSEXP);
+    rcpp_result_gen = Rcpp::wrap(aphylo_model_eval(model_ptr, p));
+    return rcpp_result_gen;
+END_RCPP
+}
+// new_aphylo_hier_model
+SEXP new_aphylo_hier_model(const List& trees, const std::vector< unsigned int >& classes, const std::vector< std::string >& par_names, const std::vector< std::vector< unsigned int > >& pos, const std::vector< unsigned int >& alpha_pos, const std::vector< unsigned int >& beta_pos, unsigned int npars, bool factorized, std::string scaling, int nthreads, bool reduced_pseq);
+RcppExport SEXP _aphylo_new_aphylo_hier_model(SEXP treesSEXP, SEXP classesSEXP, SEXP par_namesSEXP, SEXP posSEXP, SEXP alpha_posSEXP, SEXP beta_posSEXP, SEXP nparsSEXP, SEXP factorizedSEXP, SEXP scalingSEXP, SEXP nthreadsSEXP, SEXP reduced_pseqSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< const List& >::type trees(treesSEXP);
+    Rcpp::traits::input_parameter< const std::vector< unsigned int >& >::type classes(classesSEXP);
+    Rcpp::traits::input_parameter< const std::vector< std::string >& >::type par_names(par_namesSEXP);
+    Rcpp::traits::input_parameter< const std::vector< std::vector< unsigned int > >& >::type pos(posSEXP);
+    Rcpp::traits::input_parameter< const std::vector< unsigned int >& >::type alpha_pos(alpha_posSEXP);
+    Rcpp::traits::input_parameter< const std::vector< unsigned int >& >::type beta_pos(beta_posSEXP);
+    Rcpp::traits::input_parameter< unsigned int >::type npars(nparsSEXP);
+    Rcpp::traits::input_parameter< bool >::type factorized(factorizedSEXP);
+    Rcpp::traits::input_parameter< std::string >::type scaling(scalingSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type reduced_pseq(reduced_pseqSEXP);
+    rcpp_result_gen = Rcpp::wrap(new_aphylo_hier_model(trees, classes, par_names, pos, alpha_pos, beta_pos, npars, factorized, scaling, nthreads, reduced_pseq));
+    return rcpp_result_gen;
+END_RCPP
+}
+// aphylo_hier_eval
+double aphylo_hier_eval(SEXP model_ptr, const std::vector< double >& p);
+RcppExport SEXP _aphylo_aphylo_hier_eval(SEXP model_ptrSEXP, SEXP pSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model_ptr(model_ptrSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type p(pSEXP);
+    rcpp_result_gen = Rcpp::wrap(aphylo_hier_eval(model_ptr, p));
+    return rcpp_result_gen;
+END_RCPP
+}
+// LogLike_pruner_batch
+std::vector< double > LogLike_pruner_batch(SEXP tree_ptr, const NumericMatrix& par, bool factorized, std::string scaling, bool reduced_pseq);
+RcppExport SEXP _aphylo_LogLike_pruner_batch(SEXP tree_ptrSEXP, SEXP parSEXP, SEXP factorizedSEXP, SEXP scalingSEXP, SEXP reduced_pseqSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type tree_ptr(tree_ptrSEXP);
+    Rcpp::traits::input_parameter< const NumericMatrix& >::type par(parSEXP);
+    Rcpp::traits::input_parameter< bool >::type factorized(factorizedSEXP);
+    Rcpp::traits::input_parameter< std::string >::type scaling(scalingSEXP);
+    Rcpp::traits::input_parameter< bool >::type reduced_pseq(reduced_pseqSEXP);
+    rcpp_result_gen = Rcpp::wrap(LogLike_pruner_batch(tree_ptr, par, factorized, scaling, reduced_pseq));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -157,6 +277,17 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// Tree_get_nupdated
+unsigned int Tree_get_nupdated(const SEXP& phy);
+RcppExport SEXP _aphylo_Tree_get_nupdated(SEXP phySEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const SEXP& >::type phy(phySEXP);
+    rcpp_result_gen = Rcpp::wrap(Tree_get_nupdated(phy));
+    return rcpp_result_gen;
+END_RCPP
+}
 // auc
 List auc(NumericVector pred, IntegerVector labels, int nc, bool nine_na);
 RcppExport SEXP _aphylo_auc(SEXP predSEXP, SEXP labelsSEXP, SEXP ncSEXP, SEXP nine_naSEXP) {
@@ -171,6 +302,26 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// aphylo_mcmc_native
+List aphylo_mcmc_native(SEXP model_ptr, const NumericMatrix& initial, int nsteps, int burnin, int thin, bool adaptive, double scale, int warmup, double eps, const std::vector< double >& seeds, int nthreads);
+RcppExport SEXP _aphylo_aphylo_mcmc_native(SEXP model_ptrSEXP, SEXP initialSEXP, SEXP nstepsSEXP, SEXP burninSEXP, SEXP thinSEXP, SEXP adaptiveSEXP, SEXP scaleSEXP, SEXP warmupSEXP, SEXP epsSEXP, SEXP seedsSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model_ptr(model_ptrSEXP);
+    Rcpp::traits::input_parameter< const NumericMatrix& >::type initial(initialSEXP);
+    Rcpp::traits::input_parameter< int >::type nsteps(nstepsSEXP);
+    Rcpp::traits::input_parameter< int >::type burnin(burninSEXP);
+    Rcpp::traits::input_parameter< int >::type thin(thinSEXP);
+    Rcpp::traits::input_parameter< bool >::type adaptive(adaptiveSEXP);
+    Rcpp::traits::input_parameter< double >::type scale(scaleSEXP);
+    Rcpp::traits::input_parameter< int >::type warmup(warmupSEXP);
+    Rcpp::traits::input_parameter< double >::type eps(epsSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type seeds(seedsSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(aphylo_mcmc_native(model_ptr, initial, nsteps, burnin, thin, adaptive, scale, warmup, eps, seeds, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
 // states
 IntegerMatrix states(int P);
 RcppExport SEXP _aphylo_states(SEXP PSEXP) {
@@ -215,18 +366,47 @@ BEGIN_RCPP
 END_RCPP
 }
 // posterior_prob
-List posterior_prob(const NumericMatrix& Pr_postorder, const std::vector< unsigned int >& types, const NumericVector& mu_d, const NumericVector& mu_s, const double& Pi, const IntegerVector& pseq, const List& offspring);
-RcppExport SEXP _aphylo_posterior_prob(SEXP Pr_postorderSEXP, SEXP typesSEXP, SEXP mu_dSEXP, SEXP mu_sSEXP, SEXP PiSEXP, SEXP pseqSEXP, SEXP offspringSEXP) {
+List posterior_prob(SEXP tree_ptr, const std::vector< double >& mu_d, const std::vector< double >& mu_s, const std::vector< double >& psi, const std::vector< double >& eta, const double& Pi);
+RcppExport SEXP _aphylo_posterior_prob(SEXP tree_ptrSEXP, SEXP mu_dSEXP, SEXP mu_sSEXP, SEXP psiSEXP, SEXP etaSEXP, SEXP PiSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
-    Rcpp::traits::input_parameter< const NumericMatrix& >::type Pr_postorder(Pr_postorderSEXP);
-    Rcpp::traits::input_parameter< const std::vector< unsigned int >& >::type types(typesSEXP);
-    Rcpp::traits::input_parameter< const NumericVector& >::type mu_d(mu_dSEXP);
-    Rcpp::traits::input_parameter< const NumericVector& >::type mu_s(mu_sSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type tree_ptr(tree_ptrSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type mu_d(mu_dSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type mu_s(mu_sSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type psi(psiSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type eta(etaSEXP);
     Rcpp::traits::input_parameter< const double& >::type Pi(PiSEXP);
-    Rcpp::traits::input_parameter< const IntegerVector& >::type pseq(pseqSEXP);
-    Rcpp::traits::input_parameter< const List& >::type offspring(offspringSEXP);
-    rcpp_result_gen = Rcpp::wrap(posterior_prob(Pr_postorder, types, mu_d, mu_s, Pi, pseq, offspring));
+    rcpp_result_gen = Rcpp::wrap(posterior_prob(tree_ptr, mu_d, mu_s, psi, eta, Pi));
+    return rcpp_result_gen;
+END_RCPP
+}
+// posterior_loo_pruner
+NumericMatrix posterior_loo_pruner(SEXP tree_ptr, const std::vector< double >& mu_d, const std::vector< double >& mu_s, const std::vector< double >& psi, const std::vector< double >& eta, const double& Pi);
+RcppExport SEXP _aphylo_posterior_loo_pruner(SEXP tree_ptrSEXP, SEXP mu_dSEXP, SEXP mu_sSEXP, SEXP psiSEXP, SEXP etaSEXP, SEXP PiSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type tree_ptr(tree_ptrSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type mu_d(mu_dSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type mu_s(mu_sSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type psi(psiSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< const double& >::type Pi(PiSEXP);
+    rcpp_result_gen = Rcpp::wrap(posterior_loo_pruner(tree_ptr, mu_d, mu_s, psi, eta, Pi));
+    return rcpp_result_gen;
+END_RCPP
+}
+// posterior_pruner
+List posterior_pruner(SEXP tree_ptr, const std::vector< double >& mu_d, const std::vector< double >& mu_s, const std::vector< double >& psi, const std::vector< double >& eta, const double& Pi);
+RcppExport SEXP _aphylo_posterior_pruner(SEXP tree_ptrSEXP, SEXP mu_dSEXP, SEXP mu_sSEXP, SEXP psiSEXP, SEXP etaSEXP, SEXP PiSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type tree_ptr(tree_ptrSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type mu_d(mu_dSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type mu_s(mu_sSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type psi(psiSEXP);
+    Rcpp::traits::input_parameter< const std::vector< double >& >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< const double& >::type Pi(PiSEXP);
+    rcpp_result_gen = Rcpp::wrap(posterior_pruner(tree_ptr, mu_d, mu_s, psi, eta, Pi));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -263,10 +443,19 @@ BEGIN_RCPP
 END_RCPP
 }
 
+void init_Pr_view(DllInfo* dll);
 static const R_CallMethodDef CallEntries[] = {
-    {"_aphylo_new_aphylo_pruner_cpp", (DL_FUNC) &_aphylo_new_aphylo_pruner_cpp, 4},
+    {"_aphylo_new_aphylo_pruner_cpp", (DL_FUNC) &_aphylo_new_aphylo_pruner_cpp, 5},
     {"_aphylo_sizeof_pruner", (DL_FUNC) &_aphylo_sizeof_pruner, 1},
-    {"_aphylo_LogLike_pruner", (DL_FUNC) &_aphylo_LogLike_pruner, 8},
+    {"_aphylo_LogLike_pruner", (DL_FUNC) &_aphylo_LogLike_pruner, 13},
+    {"_aphylo_new_aphylo_pruner_pool", (DL_FUNC) &_aphylo_new_aphylo_pruner_pool, 1},
+    {"_aphylo_aphylo_pruner_pool_valid", (DL_FUNC) &_aphylo_aphylo_pruner_pool_valid, 2},
+    {"_aphylo_LogLike_pruner_pool", (DL_FUNC) &_aphylo_LogLike_pruner_pool, 10},
+    {"_aphylo_new_aphylo_model", (DL_FUNC) &_aphylo_new_aphylo_model, 9},
+    {"_aphylo_aphylo_model_eval", (DL_FUNC) &_aphylo_aphylo_model_eval, 2},
+    {"_aphylo_new_aphylo_hier_model", (DL_FUNC) &_aphylo_new_aphylo_hier_model, 11},
+    {"_aphylo_aphylo_hier_eval", (DL_FUNC) &_aphylo_aphylo_hier_eval, 2},
+    {"_aphylo_LogLike_pruner_batch", (DL_FUNC) &_aphylo_LogLike_pruner_batch, 5},
     {"_aphylo_Tree_get_offspring", (DL_FUNC) &_aphylo_Tree_get_offspring, 1},
     {"_aphylo_Tree_get_parents", (DL_FUNC) &_aphylo_Tree_get_parents, 1},
     {"_aphylo_Tree_Nnode", (DL_FUNC) &_aphylo_Tree_Nnode, 2},
@@ -277,12 +466,16 @@ static const R_CallMethodDef CallEntries[] = {
     {"_aphylo_Tree_Nann", (DL_FUNC) &_aphylo_Tree_Nann, 1},
     {"_aphylo_Tree_set_ann", (DL_FUNC) &_aphylo_Tree_set_ann, 4},
     {"_aphylo_Tree_get_ann", (DL_FUNC) &_aphylo_Tree_get_ann, 1},
+    {"_aphylo_Tree_get_nupdated", (DL_FUNC) &_aphylo_Tree_get_nupdated, 1},
     {"_aphylo_auc", (DL_FUNC) &_aphylo_auc, 4},
+    {"_aphylo_aphylo_mcmc_native", (DL_FUNC) &_aphylo_aphylo_mcmc_native, 11},
     {"_aphylo_states", (DL_FUNC) &_aphylo_states, 1},
     {"_aphylo_prob_mat", (DL_FUNC) &_aphylo_prob_mat, 1},
     {"_aphylo_root_node_prob", (DL_FUNC) &_aphylo_root_node_prob, 2},
     {"_aphylo_reduce_pseq", (DL_FUNC) &_aphylo_reduce_pseq, 3},
-    {"_aphylo_posterior_prob", (DL_FUNC) &_aphylo_posterior_prob, 7},
+    {"_aphylo_posterior_prob", (DL_FUNC) &_aphylo_posterior_prob, 6},
+    {"_aphylo_posterior_loo_pruner", (DL_FUNC) &_aphylo_posterior_loo_pruner, 6},
+    {"_aphylo_posterior_pruner", (DL_FUNC) &_aphylo_posterior_pruner, 6},
     {"_aphylo_sim_fun_on_tree", (DL_FUNC) &_aphylo_sim_fun_on_tree, 9},
     {"_aphylo_sim_tree", (DL_FUNC) &_aphylo_sim_tree, 3},
     {NULL, NULL, 0}
@@ -291,4 +484,5 @@ static const R_CallMethodDef CallEntries[] = {
 RcppExport void R_init_aphylo(DllInfo *dll) {
     R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
+    init_Pr_view(dll);
 }
@@ -1,11 +1,73 @@
 #include <Rcpp.h>
 #include <stdexcept>
+#include <limits>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <memory>
 #include "pruner.hpp"
+#include "flat_storage.hpp"
 using namespace Rcpp;
 
 #ifndef APHYLO_TREEDATA_HPP
 #define APHYLO_TREEDATA_HPP 1
 
+// How the probabilities in TreeData::Pr are stored (see likelihood())
+// - NONE: Raw probabilities. Large trees may underflow to zero.
+// - RESCALE: Raw probabilities, but rows are rescaled by a power of two when
+//   their largest value falls below APHYLO_SCALING_THRESHOLD. The log of the
+//   factors is kept in TreeData::Pr_lscale.
+// - LOG: Log-probabilities, integrated using log-sum-exp.
+#define APHYLO_SCALING_NONE    0u
+#define APHYLO_SCALING_RESCALE 1u
+#define APHYLO_SCALING_LOG     2u
+
+// 2^-256
+#ifndef APHYLO_SCALING_THRESHOLD
+#define APHYLO_SCALING_THRESHOLD 8.6361685550944446e-78
+#endif
+
+#define APHYLO_LN2 0.69314718055994530942
+
+// Default memory budget (in bytes) for TreeData::Pr, 16 GB (see
+// TreeData::init_Pr)
+#ifndef APHYLO_MAX_BYTES
+#define APHYLO_MAX_BYTES 17179869184.0
+#endif
+
+// Largest number of functions for which the 2^P x 2^P transition matrices are
+// tabulated (see TreeData::update_transition). Each takes 8 x 4^P bytes, i.e.,
+// 8 MB per node type with 10 functions.
+#ifndef APHYLO_TRANSITION_MAX_FUNS
+#define APHYLO_TRANSITION_MAX_FUNS 10u
+#endif
+
+// Number of states from which tabulated transitions are applied using BLAS
+// (see transition_matvec())
+#ifndef APHYLO_BLAS_MIN_STATES
+#define APHYLO_BLAS_MIN_STATES 64u
+#endif
+
+// Parameters on which the probabilities of a node depend (see
+// TreeData::changed and AphyloPruner::update)
+#define APHYLO_DEP_TIP  1u // psi and eta
+#define APHYLO_DEP_MU_D 2u
+#define APHYLO_DEP_MU_S 4u
+#define APHYLO_DEP_PI   8u
+
+// Position of the model parameters in parameter vectors (same as
+// APHYLO_PARAM_NAMES in R/formulas.R)
+#define APHYLO_PAR_PSI0  0u
+#define APHYLO_PAR_PSI1  1u
+#define APHYLO_PAR_MU_D0 2u
+#define APHYLO_PAR_MU_D1 3u
+#define APHYLO_PAR_MU_S0 4u
+#define APHYLO_PAR_MU_S1 5u
+#define APHYLO_PAR_ETA0  6u
+#define APHYLO_PAR_ETA1  7u
+#define APHYLO_PAR_PI    8u
+#define APHYLO_NPARS     9u
+
 // This function creates pre-filled arrays
 template <class T>
 inline std::vector< std::vector< T > > new_vector_array(
@@ -43,9 +105,10 @@ inline std::vector< std::vector< unsigned int > > states_mat(
 }
 
 // Replaces values of a transition matrix
+template <class Mat>
 inline void transition_mat(
     const std::vector< double > & pr,
-    std::vector< std::vector< double > > & ans
+    Mat & ans
   ) {
   
   for (pruner::uint i = 0u; i < 2u; ++i)
@@ -60,11 +123,11 @@ inline void transition_mat(
 }
 
 // Initializes a transition matrix (2 x 2)
-inline std::vector< std::vector< double > > transition_mat(
+inline mat22 transition_mat(
     const std::vector< double > & pr
 ) {
   
-  std::vector< std::vector< double > > ans = new_vector_array(2u, 2u, 0.0);
+  mat22 ans;
   
   transition_mat(pr, ans);
   
@@ -73,10 +136,11 @@ inline std::vector< std::vector< double > > transition_mat(
 
 // Computes the vector of rootnode probs depending on the set of possible
 // states
+template <class States>
 inline void root_node_pr(
     std::vector< double > & Pr_root,
     double pi,
-    const std::vector< std::vector< unsigned int > > & S
+    const States & S
 ) {
   
   for (pruner::uint s = 0u; s < S.size(); ++s) {
@@ -127,6 +191,35 @@ inline double AphyloParameter::operator[](unsigned int i) const {
 Definition of tree data 
 *******************************************************************************/
 
+/**@brief Annotations and types of the nodes of a tree.
+ * 
+ * This is shared by all the workspaces (TreeData objects) of a tree, so
+ * creating a new workspace does not copy it (see AphyloPruner::acquire). Every
+ * time an annotation changes, `version` is increased, so the workspaces that
+ * didn't make the change know that their probabilities are outdated.
+ */
+class TreeInfo {
+public:
+  
+  AnnotationMatrix A;
+  pruner::v_uint types;
+  unsigned long version = 0u;
+  
+  TreeInfo(const pruner::vv_uint & A_, const pruner::v_uint & types_) :
+    A(A_), types(types_) {};
+  ~TreeInfo() {};
+  
+};
+
+/**@brief Workspace to compute the likelihood of a tree.
+ * 
+ * Holds the model parameters and the probabilities of the nodes for a single
+ * evaluation, while the annotations are shared with the other workspaces of
+ * the tree through `info`. Multiple threads can compute the likelihood of the
+ * same tree at the same time as long as each uses its own TreeData (see
+ * AphyloPruner::update), but annotations can only be modified when no
+ * evaluation is running.
+ */
 class TreeData {
   
 public:
@@ -137,87 +230,230 @@ public:
   pruner::uint nannotated;
   double prop_type_d;
   
-  // Annotations
-  pruner::vv_uint A;
-  pruner::v_uint types;
+  // Annotations (shared, see set_ann)
+  std::shared_ptr< TreeInfo > info;
+  unsigned long info_version = 0u;
+  const AnnotationMatrix & A;
+  const pruner::v_uint & types;
   
   // Temporal storage ----------------------------------------------------------
-  pruner::vv_uint states;
-  pruner::vv_dbl Pr;
+  StateBits states;
+  StateMatrix Pr; // Allocated by init_Pr()
+  double max_bytes;
+  pruner::v_dbl Pr_lscale;
   double ll;
   
+  // Scratch space used by the kernels, nstates per thread (see set_nthreads)
+  pruner::v_dbl Pr_off;
+  bool factorized = false;
+  pruner::uint scaling = APHYLO_SCALING_RESCALE;
+  
   // Model parameters
-  pruner::vv_dbl PSI,
+  mat22 PSI = {},
     // Duplication and Speciation mu
-    MU_d, MU_s;
-  std::vector< pruner::vv_dbl* > MU;
+    MU_d = {}, MU_s = {};
   pruner::v_dbl eta, Pi;  
+  double pi = 0.5;
+  
+  // Emission probabilities of the tips and their logs (see set_tip_pr)
+  mat23 tip_pr = {}, tip_lpr = {};
+  
+  // Transition matrices between the 2^P states of each node type, row-major,
+  // and in the log scale if scaling is LOG. Empty if not tabulated (see
+  // update_transition).
+  pruner::v_dbl TM_d, TM_s;
+  bool TM_dirty = true;
+  
+  // Cache of Pr (see AphyloPruner::update). Changing the scaling or the
+  // kernel invalidates all the rows. Changing a parameter only invalidates
+  // the rows that depend on it (flagged in `changed` with APHYLO_DEP_*), and
+  // changing an annotation only the path from that node to the root.
+  bool all_dirty = true;
+  pruner::uint changed = 0u;
+  pruner::v_uint dirty;
+  
+  // Flags the nodes already queued during a partial update
+  std::vector< bool > in_update;
   
-  void set_mu_d(const pruner::v_dbl & mu_d_) {return transition_mat(mu_d_, this->MU_d);}
-  void set_mu_s(const pruner::v_dbl & mu_s_) {return transition_mat(mu_s_, this->MU_s);}
-  void set_psi(const pruner::v_dbl & psi_) {return transition_mat(psi_, this->PSI);}
-  void set_eta(const pruner::v_dbl & eta_) {this->eta = eta_;return;}
-  void  set_pi(double pi_) {root_node_pr(this->Pi, pi_, states);return;}
+  // Whether to use the reduced pruning sequence when possible, and the
+  // sequence the rows of Pr were computed with (see AphyloPruner::update)
+  bool reduced = true;
+  pruner::uint pseq_id = 0u;
+  
+  // Number of nodes pruned by the last update (all of the sequence in a full
+  // pass), see AphyloPruner::update
+  pruner::uint nupdated = 0u;
+  
+  void set_reduced(bool reduced_) {
+    this->reduced = reduced_;
+    return;
+  }
+  
+  //! Whether the annotation bias (eta) is included in the model
+  bool use_eta() const {
+    return (eta.size() >= 2u) && (eta[0u] >= 0.0);
+  }
+  
+  void set_mu_d(const pruner::v_dbl & mu_d_) {
+    if (set_mat(mu_d_, this->MU_d)) {
+      changed |= APHYLO_DEP_MU_D;
+      TM_dirty = true;
+    }
+    return;
+  }
+  void set_mu_s(const pruner::v_dbl & mu_s_) {
+    if (set_mat(mu_s_, this->MU_s)) {
+      changed |= APHYLO_DEP_MU_S;
+      TM_dirty = true;
+    }
+    return;
+  }
+  void set_psi(const pruner::v_dbl & psi_) {
+    if (set_mat(psi_, this->PSI))
+      changed |= APHYLO_DEP_TIP;
+    set_tip_pr();
+    return;
+  }
+  void set_eta(const pruner::v_dbl & eta_) {
+    if (eta_ != this->eta)
+      changed |= APHYLO_DEP_TIP;
+    this->eta = eta_;
+    set_tip_pr();
+    return;
+  }
+  void  set_pi(double pi_) {
+    if (pi_ != this->pi)
+      changed |= APHYLO_DEP_PI;
+    this->pi = pi_;
+    root_node_pr(this->Pi, pi_, states);
+    return;
+  }
+  void set_params(
+    const pruner::v_dbl & mu_d_,
+    const pruner::v_dbl & mu_s_,
+    const pruner::v_dbl & psi_,
+    const pruner::v_dbl & eta_,
+    double Pi_
+  );
+  void set_factorized(bool factorized_) {
+    if (factorized_ != this->factorized)
+      all_dirty = TM_dirty = true;
+    this->factorized = factorized_;
+    return;
+  }
+  void set_nthreads(pruner::uint nthreads_) {
+    this->Pr_off.resize((std::size_t) std::max(nthreads_, 1u) * nstates, 1.0);
+    return;
+  }
+  void set_scaling(pruner::uint scaling_) {
+    if (scaling_ > APHYLO_SCALING_LOG)
+      throw std::invalid_argument("Invalid scaling mode.");
+    
+    // Nodes not included in the pruning sequence are never updated, so they
+    // need to hold the neutral element of the new scale (1 or log(1)).
+    if ((scaling_ == APHYLO_SCALING_LOG) != (this->scaling == APHYLO_SCALING_LOG)) {
+      TM_dirty = true;
+      Pr.detach();
+      std::fill(
+        Pr.ptr(), Pr.ptr() + Pr.nelem(),
+        scaling_ == APHYLO_SCALING_LOG ? 0.0 : 1.0
+        );
+    }
+    
+    if (scaling_ != this->scaling)
+      all_dirty = true;
+    
+    this->scaling = scaling_;
+    return;
+  }
   
   // Set annotation
   void set_ann(const unsigned int i, const unsigned int j, unsigned int x) {
     
-    this->A[i][j] = x;  
+    if (this->A(i, j) == x)
+      return;
+    
+    // Other workspaces will do a full update (see AphyloPruner::update)
+    bool up_to_date = (this->info_version == info->version);
+    info->A.set(i, j, x);
+    ++info->version;
+    
+    if (up_to_date)
+      this->info_version = info->version;
+    
+    this->dirty.push_back(i);
     return;
     
   }
   
+  //! Bytes needed to store `nrows` rows of Pr with `nfuns_` functions
+  static double Pr_bytes(double nrows, pruner::uint nfuns_) {
+    return nrows * std::ldexp((double) sizeof(double), (int) nfuns_);
+  }
+  
+  //! Node x state matrix laid out as Pr would be (see init_Pr)
+  StateMatrix new_Pr(const pruner::v_uint & pseq, double val) const;
+  
+  void init_Pr(const pruner::v_uint & pseq);
+  
+  //! Sets all the rows to the neutral element before pruning `pseq`
+  void reset_Pr(const pruner::v_uint & pseq);
+  
+  //! Tabulates the transition matrices if the parameters changed (see TM_d)
+  void update_transition();
+  
+private:
+  
+  std::string Pr_bytes_msg(double nrows) const;
+  
+  void set_tip_pr();
+  
+  // Returns true if `M` changed
+  bool set_mat(const pruner::v_dbl & pr, mat22 & M) {
+    mat22 M_ = transition_mat(pr);
+    bool ans = M_ != M;
+    M = M_;
+    return ans;
+  }
+  
+public:
+  
   // Destructor and constructor ------------------------------------------------
   ~TreeData() {};
   TreeData(
     const pruner::vv_uint A_,
     const pruner::v_uint Ntype_,
-    pruner::uint nannotated
-    ) : A(A_), types(Ntype_) {
+    pruner::uint nannotated,
+    double max_bytes_ = APHYLO_MAX_BYTES
+    ) : info(std::make_shared< TreeInfo >(A_, Ntype_)), A(info->A),
+    types(info->types), max_bytes(max_bytes_) {
     
     // Initializing data
     // this->A       = A;
     // this->types   = types;
     
-    // Consistency checks
-    int current_size = -1;
-    for (auto iter = A.begin(); iter != A.end(); ++iter) {
-      
-      if (current_size < 0) {
-        current_size = iter->size();
-        continue;
-      }
-      
-      if ((int) iter->size() != current_size)
-        stop("All function annotations in A have to have the same length.");
-    }
+    // Consistency checks: AnnotationMatrix already verifies that all the rows
+    // have the same length and that the values are either 0, 1, or 9.
     
     // Getting meta info, and initializing containers
-    this->nfuns      = A[0].size();
-    this->n          = A.size();
+    this->nfuns      = A.ncols();
+    this->n          = A.nrows();
     this->nannotated = nannotated;
-    this->states     = states_mat(this->nfuns);
+    
+    // At least the root and the shared row (see init_Pr) must fit
+    if ((this->nfuns > 30u) || (Pr_bytes(2.0, this->nfuns) > max_bytes))
+      throw std::length_error(Pr_bytes_msg(2.0));
+    
+    this->states     = StateBits(this->nfuns);
     this->nstates    = this->states.size();
-    this->Pr         = new_vector_array(this->n, this->nstates, 1.0);
+    this->Pr_off.resize(this->nstates, 1.0);
+    this->Pr_lscale.resize(this->n, 0.0);
+    this->in_update.resize(this->n, false);
     
     // Initializing parameter containers
     eta.resize(2u, 0.0);
     Pi.resize(nstates, 0.0);
     
-    MU_d.resize(2u);
-    MU_d[0].resize(2u);
-    MU_d[1].resize(2u);
-    
-    MU_s.resize(2u);
-    MU_s[0].resize(2u);
-    MU_s[1].resize(2u);
-    
-    MU.resize(2u);
-    
-    PSI.resize(2u);
-    PSI[0].resize(2u);
-    PSI[1].resize(2u);
-    
     // Counting the proportion of type 0
     double increments = 1.0/this->n;
     this->prop_type_d = 0.0;
@@ -231,8 +467,181 @@ public:
     }
     
     ll = 0.0;
+    set_tip_pr();
     
   };
 };
 
+/**@brief Fills `TM_d` and `TM_s`, the 2^P x 2^P transition matrices.
+ * 
+ * The probability of moving from state `s` to `s_n` is the product over the
+ * functions of the 2x2 transition matrix (see likelihood()), so it only
+ * depends on the node type and the parameters. These are not needed with the
+ * factorized kernel, and are not tabulated when P exceeds
+ * APHYLO_TRANSITION_MAX_FUNS.
+ */
+inline void TreeData::update_transition() {
+  
+  if (!TM_dirty)
+    return;
+  
+  TM_dirty = false;
+  if (factorized || (nfuns > APHYLO_TRANSITION_MAX_FUNS)) {
+    TM_d.clear();
+    TM_s.clear();
+    return;
+  }
+  
+  bool logscale = scaling == APHYLO_SCALING_LOG;
+  auto fill = [this, logscale](const mat22 & M, pruner::v_dbl & TM) {
+    
+    TM.resize((std::size_t) nstates * nstates);
+    for (pruner::uint s = 0u; s < nstates; ++s)
+      for (pruner::uint s_n = 0u; s_n < nstates; ++s_n) {
+        
+        double pr = 1.0;
+        for (pruner::uint p = 0u; p < nfuns; ++p)
+          pr *= M[states[s][p]][states[s_n][p]];
+        
+        TM[(std::size_t) s * nstates + s_n] = logscale ? log(pr) : pr;
+        
+      }
+    
+  };
+  
+  fill(MU_d, TM_d);
+  fill(MU_s, TM_s);
+  
+  return;
+  
+}
+
+/**@brief Tabulates the contribution of each function to the probability of a
+ * tip, `tip_pr[state][annotation]`, with the annotation being 0, 1, or 2 if
+ * missing (see AnnotationMatrix::code).
+ * 
+ * These only depend on psi and eta: if eta is used (non-negative), a missing
+ * annotation has probability `sum_a (1 - eta[a]) * PSI[state][a]`, and an
+ * observed one `PSI[state][a] * eta[a]`. Otherwise, missing annotations do not
+ * contribute (probability 1) and observed ones have `PSI[state][a]`.
+ */
+inline void TreeData::set_tip_pr() {
+  
+  bool use_eta = this->use_eta();
+  for (pruner::uint s = 0u; s < 2u; ++s) {
+    
+    for (pruner::uint a = 0u; a < 2u; ++a)
+      tip_pr[s][a] = use_eta ? PSI[s][a] * eta[a] : PSI[s][a];
+    
+    tip_pr[s][2u] = use_eta ?
+      (1.0 - eta[0u]) * PSI[s][0u] + (1.0 - eta[1u]) * PSI[s][1u] : 1.0;
+    
+    for (pruner::uint a = 0u; a < 3u; ++a)
+      tip_lpr[s][a] = log(tip_pr[s][a]);
+    
+  }
+  
+  return;
+  
+}
+
+/**@brief Allocates `Pr` within the memory budget (`max_bytes`).
+ * 
+ * If a row per node (n x 2^P doubles) fits in the budget, that is what is
+ * stored. Otherwise, only the rows of the nodes in the pruning sequence `pseq`
+ * are stored, which is all that the likelihood writes to, and the rest share
+ * a single row of ones (see StateMatrix). Throws `std::length_error` if not
+ * even that fits.
+ */
+inline void TreeData::init_Pr(const pruner::v_uint & pseq) {
+  
+  this->Pr = new_Pr(pseq, 1.0);
+  return;
+  
+}
+
+inline StateMatrix TreeData::new_Pr(
+    const pruner::v_uint & pseq,
+    double val
+) const {
+  
+  if (Pr_bytes(this->n, this->nfuns) <= max_bytes)
+    return StateMatrix(this->n, this->nstates, val);
+  
+  if (Pr_bytes(pseq.size() + 1.0, this->nfuns) > max_bytes)
+    throw std::length_error(Pr_bytes_msg(pseq.size() + 1.0));
+  
+  return StateMatrix(pseq, this->n, this->nstates, val);
+  
+}
+
+/**@brief Resets `Pr` when switching to the pruning sequence `pseq`.
+ * 
+ * Nodes not in the pruning sequence are never updated, so these must hold the
+ * neutral element of the scale (as in set_scaling) and no scaling factor. If
+ * only the rows of the nodes in the previous sequence were stored, `Pr` is
+ * reallocated for the new one (see init_Pr).
+ */
+inline void TreeData::reset_Pr(const pruner::v_uint & pseq) {
+  
+  if (Pr.share_rowmap())
+    init_Pr(pseq);
+  else
+    Pr.detach();
+  
+  std::fill(
+    Pr.ptr(), Pr.ptr() + Pr.nelem(),
+    scaling == APHYLO_SCALING_LOG ? 0.0 : 1.0
+    );
+  
+  std::fill(Pr_lscale.begin(), Pr_lscale.end(), 0.0);
+  
+  return;
+  
+}
+
+inline std::string TreeData::Pr_bytes_msg(double nrows) const {
+  
+  char msg[512];
+  snprintf(
+    msg, sizeof(msg),
+    "Storing the probabilities of %.0f nodes with %u functions (nodes x 2^P "
+    "doubles) requires %.3g GB, which exceeds the memory budget of %.3g GB "
+    "(see options(aphylo_max_memory)).",
+    nrows, this->nfuns, Pr_bytes(nrows, this->nfuns) / 1073741824.0,
+    max_bytes / 1073741824.0
+  );
+  
+  return msg;
+  
+}
+
+// Sets all the parameters of the model. In the case of Pi, if it is negative,
+// then it means that we are using the stationary value of the transition
+// probabilities.
+inline void TreeData::set_params(
+    const pruner::v_dbl & mu_d_,
+    const pruner::v_dbl & mu_s_,
+    const pruner::v_dbl & psi_,
+    const pruner::v_dbl & eta_,
+    double Pi_
+) {
+  
+  set_mu_d(mu_d_);
+  set_mu_s(mu_s_);
+  set_psi(psi_);
+  set_eta(eta_);
+  
+  if (Pi_ < 0.0)
+    set_pi(
+      (1 - prop_type_d) * mu_s_[0] / (mu_s_[0] + mu_s_[1]) +
+        prop_type_d * mu_d_[0] / (mu_d_[0] + mu_d_[1])
+    );
+  else 
+    set_pi(Pi_);
+  
+  return;
+  
+}
+
 #endif
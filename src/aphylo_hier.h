@@ -0,0 +1,234 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include "pruner.hpp"
+#include "TreeData.hpp" // TreeData definition
+#include "loglikelihood.h" // AphyloPruner definition
+#include "aphylo_model.h" // AphyloModel and log_dbeta
+
+#ifndef APHYLO_HIER_H
+#define APHYLO_HIER_H 1
+
+/**@brief Joint log-posterior of the hierarchical model, as the `joint()`
+ * function of `aphylo_hier()` (see R/aphylo_hier.R).
+ *
+ * Each class has its own set of parameters, and each of them has a beta
+ * hyperprior whose shapes (`alpha` and `beta`) are also parameters. The
+ * contribution of each tree is its log-likelihood (replaced as in
+ * `aphylo_call()` if not finite) plus the hyperprior of its class.
+ *
+ * The parameters of each class are resolved once per evaluation, and the trees
+ * of all classes are then distributed across threads from the largest to the
+ * smallest (as in AphyloPrunerPool), each tree using its default workspace.
+ * Their contributions are added in the order of the trees. Trees
+ * identical to an earlier one of the same class are not pruned (see
+ * AphyloModel::dedup), and trees with repeated columns are pruned by column
+ * (see AphyloModel::columns).
+ */
+class AphyloHierModel {
+public:
+
+  //! One model (uniform prior) per class, with the trees of the class
+  std::vector< AphyloModel > models;
+
+  //! Position of the parameters of each class in the vector of parameters
+  std::vector< pruner::v_uint > pos;
+
+  //! Position of the shapes of the hyperprior of each parameter
+  pruner::v_uint alpha_pos, beta_pos;
+
+  //! Length of the vector of parameters
+  pruner::uint npars;
+
+  //! Class and position within the class of each tree, as given
+  std::vector< std::pair< pruner::uint, pruner::uint > > tree_pos;
+
+  //! Order in which the trees are processed (largest first), as in tree_pos
+  std::vector< std::pair< pruner::uint, pruner::uint > > order;
+
+  int nthreads;
+
+  AphyloHierModel(
+    const std::vector< AphyloPruner * > & trees,
+    const pruner::v_uint & classes,
+    const std::vector< std::string > & par_names,
+    const std::vector< pruner::v_uint > & pos_,
+    const pruner::v_uint & alpha_pos_,
+    const pruner::v_uint & beta_pos_,
+    pruner::uint npars_,
+    bool factorized,
+    pruner::uint scaling,
+    int nthreads_ = 1,
+    bool reduced = true
+  );
+  ~AphyloHierModel() {};
+
+  double operator()(const double * par) const;
+
+};
+
+inline AphyloHierModel::AphyloHierModel(
+    const std::vector< AphyloPruner * > & trees,
+    const pruner::v_uint & classes,
+    const std::vector< std::string > & par_names,
+    const std::vector< pruner::v_uint > & pos_,
+    const pruner::v_uint & alpha_pos_,
+    const pruner::v_uint & beta_pos_,
+    pruner::uint npars_,
+    bool factorized,
+    pruner::uint scaling,
+    int nthreads_,
+    bool reduced
+) : pos(pos_), alpha_pos(alpha_pos_), beta_pos(beta_pos_), npars(npars_),
+  nthreads(nthreads_) {
+
+  if (classes.size() != trees.size())
+    throw std::length_error("-classes- should have one element per tree.");
+
+  if ((alpha_pos.size() != par_names.size()) || (beta_pos.size() != par_names.size()))
+    throw std::length_error("There should be one hyperprior per parameter.");
+
+  // Checking positions
+  for (auto p = pos.begin(); p != pos.end(); ++p) {
+
+    if (p->size() != par_names.size())
+      throw std::length_error("Each class should have one position per parameter.");
+
+    for (auto i = p->begin(); i != p->end(); ++i)
+      if (*i >= npars)
+        throw std::out_of_range("Position of a parameter out of range.");
+
+  }
+
+  for (pruner::uint k = 0u; k < par_names.size(); ++k)
+    if ((alpha_pos[k] >= npars) || (beta_pos[k] >= npars))
+      throw std::out_of_range("Position of a hyperparameter out of range.");
+
+  // Trees of each class
+  std::vector< std::vector< AphyloPruner * > > members(pos.size());
+  for (pruner::uint i = 0u; i < trees.size(); ++i) {
+
+    if (classes[i] >= pos.size())
+      throw std::out_of_range("Class out of range.");
+
+    order.push_back({classes[i], (pruner::uint) members[classes[i]].size()});
+    members[classes[i]].push_back(trees[i]);
+
+  }
+
+  pruner::v_dbl noshape;
+  models.reserve(pos.size());
+  for (pruner::uint c = 0u; c < pos.size(); ++c)
+    models.push_back(AphyloModel(
+      members[c], par_names, noshape, noshape, true, factorized, scaling, 1,
+      reduced
+    ));
+
+  // Largest trees first
+  tree_pos = order;
+  auto size = [this](const std::pair< pruner::uint, pruner::uint > & t) {
+    const AphyloPruner * tree = models[t.first].trees[t.second];
+    return tree->get_pseq(true).size() * tree->D.nstates;
+  };
+
+  std::stable_sort(order.begin(), order.end(),
+    [&size](
+      const std::pair< pruner::uint, pruner::uint > & a,
+      const std::pair< pruner::uint, pruner::uint > & b
+    ) {return size(a) > size(b);});
+
+  return;
+
+}
+
+inline double AphyloHierModel::operator()(const double * par) const {
+
+  // Arguments and hyperprior of each class
+  pruner::uint nclasses = models.size();
+  std::vector< pruner::v_dbl > psi(nclasses), mu_d(nclasses), mu_s(nclasses),
+    eta(nclasses);
+  pruner::v_dbl Pi(nclasses), hprior(nclasses, 0.0);
+  pruner::v_dbl par_c;
+
+  for (pruner::uint c = 0u; c < nclasses; ++c) {
+
+    par_c.resize(pos[c].size());
+    for (pruner::uint k = 0u; k < pos[c].size(); ++k) {
+
+      par_c[k]   = par[pos[c][k]];
+      hprior[c] += log_dbeta(par_c[k], par[alpha_pos[k]], par[beta_pos[k]]);
+
+    }
+
+    models[c].get_params(&par_c[0u], psi[c], mu_d[c], mu_s[c], eta[c], Pi[c]);
+
+  }
+
+  // Each tree is pruned serially using its own default workspace. Errors are
+  // raised afterwards (see AphyloPrunerPool::update).
+  int ntrees = (int) order.size();
+  std::vector< std::string > errors(ntrees);
+  std::vector< bool > use_dedup(nclasses), use_columns(nclasses);
+  std::vector< pruner::v_dbl > ll(nclasses);
+  std::vector< std::vector< TreeData * > > W(nclasses);
+  for (pruner::uint c = 0u; c < nclasses; ++c) {
+    use_dedup[c]   = models[c].dedup.valid(models[c].trees);
+    use_columns[c] = models[c].columns.valid(models[c].trees);
+    ll[c].resize(models[c].trees.size());
+    W[c] = models[c].workspaces();
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads) if (nthreads > 1)
+#endif
+  for (int k = 0; k < ntrees; ++k) {
+
+    pruner::uint c = order[k].first, i = order[k].second;
+    const AphyloModel & m = models[c];
+
+    if (use_dedup[c] && (m.dedup.rep[i] != i))
+      continue;
+
+    double & ll_i = ll[c][i];
+    try {
+      ll_i = m.log_likelihood(
+        i, W[c], psi[c], mu_d[c], mu_s[c], eta[c], Pi[c], 1, use_columns[c]
+      );
+    } catch (std::exception & e) {
+      errors[k] = e.what();
+    }
+
+    // Same as in aphylo_call()$fun
+    if (!std::isfinite(ll_i))
+      ll_i = -std::numeric_limits< double >::max() * 1e-10;
+
+  }
+
+  for (int k = 0; k < ntrees; ++k)
+    if (errors[k].size())
+      throw std::runtime_error(errors[k]);
+
+  // Added in the order of the trees, regardless of the number of threads
+  double ans = 0.0;
+  for (int k = 0; k < ntrees; ++k) {
+
+    pruner::uint c = tree_pos[k].first, i = tree_pos[k].second;
+    if (use_dedup[c])
+      i = models[c].dedup.rep[i];
+
+    ans += ll[c][i] + hprior[c];
+
+  }
+
+  // Same as in aphylo_hier()
+  if (!std::isfinite(ans))
+    ans = -std::numeric_limits< double >::max() * 1e-8;
+
+  return ans;
+
+}
+
+#endif
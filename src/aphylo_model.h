@@ -0,0 +1,378 @@
+#include <string>
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include "pruner.hpp"
+#include "TreeData.hpp" // TreeData definition
+#include "loglikelihood.h" // AphyloPruner definition
+
+#ifndef APHYLO_MODEL_H
+#define APHYLO_MODEL_H 1
+
+//! Same as `stats::dbeta(x, a, b, log = TRUE)`
+inline double log_dbeta(double x, double a, double b) {
+
+  if (!(a > 0.0) || !(b > 0.0))
+    return std::numeric_limits< double >::quiet_NaN();
+
+  if ((x < 0.0) || (x > 1.0))
+    return -std::numeric_limits< double >::infinity();
+
+  // Avoiding 0 * log(0) when a or b are 1
+  double ans = std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b);
+  if (a != 1.0)
+    ans += (a - 1.0) * std::log(x);
+  if (b != 1.0)
+    ans += (b - 1.0) * std::log1p(-x);
+
+  return ans;
+
+}
+
+/**@brief Objective function of a model, as the `fun` created by `aphylo_call()`
+ * (see R/formulas.R).
+ *
+ * The position of each parameter in the vector of free parameters, the priors,
+ * and the trees are resolved when the model is created, so evaluating it
+ * involves no R code. Parameters not in the model are filled as in
+ * `aphylo_loglike_args()`: `psi = (0, 0)`, `mu_s = mu_d`, and `eta` and `Pi`
+ * are not used (negative values).
+ *
+ * Priors are either uniform (as `uprior()`) or beta (as `bprior()`), with
+ * shapes recycled across the free parameters as `stats::dbeta()` does.
+ *
+ * The model does not modify the trees, so each thread can evaluate it using
+ * its own set of workspaces (see workspaces()). Trees identical to an earlier
+ * one (see ProblemDedup) are evaluated once, and so are repeated annotation
+ * columns within a tree (see ColumnDedup), as long as no annotation was
+ * modified after creating the model.
+ */
+class AphyloModel {
+public:
+
+  std::vector< AphyloPruner * > trees;
+
+  //! Groups of identical trees, built with the model
+  ProblemDedup dedup;
+
+  //! Trees split by column, built with the model. Their workspaces follow
+  //! those of the trees (see workspaces()).
+  ColumnDedup columns;
+
+  //! Position of each of the APHYLO_NPARS parameters in the free parameters
+  //! (-1 if not included)
+  std::vector< int > pos;
+  pruner::uint npars;
+
+  bool uniform;
+  pruner::v_dbl shape1, shape2;
+
+  bool factorized;
+  pruner::uint scaling;
+  int nthreads;
+  
+  //! Whether to use the reduced pruning sequence (see AphyloPruner::use_reduced)
+  bool reduced;
+
+  AphyloModel(
+    const std::vector< AphyloPruner * > & trees_,
+    const std::vector< std::string > & par_names,
+    const pruner::v_dbl & shape1_,
+    const pruner::v_dbl & shape2_,
+    bool uniform_,
+    bool factorized_,
+    pruner::uint scaling_,
+    int nthreads_ = 1,
+    bool reduced_ = true
+  );
+  ~AphyloModel() {};
+
+  //! Arguments passed to the likelihood (see TreeData::set_params)
+  void get_params(
+    const double * par,
+    pruner::v_dbl & psi,
+    pruner::v_dbl & mu_d,
+    pruner::v_dbl & mu_s,
+    pruner::v_dbl & eta,
+    double & Pi
+  ) const;
+
+  double log_prior(const double * par) const;
+
+  //! Log-likelihood of `tree` using the workspace `W` and the arguments from
+  //! get_params()
+  double log_likelihood(
+    AphyloPruner & tree,
+    TreeData & W,
+    const pruner::v_dbl & psi,
+    const pruner::v_dbl & mu_d,
+    const pruner::v_dbl & mu_s,
+    const pruner::v_dbl & eta,
+    double Pi,
+    int nthreads_
+  ) const;
+
+  //! Log-likelihood of the i-th tree using the workspaces `W` (see
+  //! workspaces()), from its columns if split and `by_columns`
+  double log_likelihood(
+    pruner::uint i,
+    std::vector< TreeData * > & W,
+    const pruner::v_dbl & psi,
+    const pruner::v_dbl & mu_d,
+    const pruner::v_dbl & mu_s,
+    const pruner::v_dbl & eta,
+    double Pi,
+    int nthreads_,
+    bool by_columns
+  ) const;
+
+  //! Sum of the log-likelihoods of the trees using the workspaces `W`
+  double log_likelihood(const double * par, std::vector< TreeData * > & W) const;
+
+  //! Log-posterior, with non-finite values replaced as in `aphylo_call()`
+  double operator()(const double * par, std::vector< TreeData * > & W) const;
+
+  //! Default workspace of each tree (`D`), used by the R interface
+  std::vector< TreeData * > workspaces() const;
+
+  //! New workspaces for a thread (see AphyloPruner::acquire)
+  std::vector< std::unique_ptr< TreeData > > acquire() const;
+  void release(std::vector< std::unique_ptr< TreeData > > & W) const;
+
+};
+
+inline AphyloModel::AphyloModel(
+    const std::vector< AphyloPruner * > & trees_,
+    const std::vector< std::string > & par_names,
+    const pruner::v_dbl & shape1_,
+    const pruner::v_dbl & shape2_,
+    bool uniform_,
+    bool factorized_,
+    pruner::uint scaling_,
+    int nthreads_,
+    bool reduced_
+) : trees(trees_), dedup(trees_), columns(trees_), pos(APHYLO_NPARS, -1), npars(par_names.size()),
+  uniform(uniform_), factorized(factorized_), scaling(scaling_),
+  nthreads(nthreads_), reduced(reduced_) {
+
+  // Same as APHYLO_PARAM_NAMES in R/formulas.R
+  static const char * names[APHYLO_NPARS] = {
+    "psi0", "psi1", "mu_d0", "mu_d1", "mu_s0", "mu_s1", "eta0", "eta1", "Pi"
+  };
+
+  for (pruner::uint i = 0u; i < npars; ++i) {
+
+    pruner::uint k = 0u;
+    while ((k < APHYLO_NPARS) && (par_names[i] != names[k]))
+      ++k;
+
+    if (k == APHYLO_NPARS)
+      throw std::invalid_argument("Unknown parameter '" + par_names[i] + "'.");
+
+    pos[k] = (int) i;
+
+  }
+
+  if ((pos[APHYLO_PAR_MU_D0] < 0) || (pos[APHYLO_PAR_MU_D1] < 0))
+    throw std::invalid_argument("The model must include mu_d0 and mu_d1.");
+
+  // Recycling the shapes
+  if (!uniform) {
+
+    if ((shape1_.size() == 0u) || (shape2_.size() == 0u))
+      throw std::invalid_argument("The shapes of the beta prior are empty.");
+
+    shape1.resize(npars);
+    shape2.resize(npars);
+    for (pruner::uint i = 0u; i < npars; ++i) {
+      shape1[i] = shape1_[i % shape1_.size()];
+      shape2[i] = shape2_[i % shape2_.size()];
+    }
+
+  }
+
+  return;
+
+}
+
+inline void AphyloModel::get_params(
+    const double * par,
+    pruner::v_dbl & psi,
+    pruner::v_dbl & mu_d,
+    pruner::v_dbl & mu_s,
+    pruner::v_dbl & eta,
+    double & Pi
+) const {
+
+  // Either the parameter or the default value
+  auto get = [this, par](pruner::uint k, double default_) {
+    return (pos[k] < 0) ? default_ : par[pos[k]];
+  };
+
+  mu_d = {par[pos[APHYLO_PAR_MU_D0]], par[pos[APHYLO_PAR_MU_D1]]};
+  mu_s = {get(APHYLO_PAR_MU_S0, mu_d[0u]), get(APHYLO_PAR_MU_S1, mu_d[1u])};
+  psi  = {get(APHYLO_PAR_PSI0, 0.0), get(APHYLO_PAR_PSI1, 0.0)};
+  eta  = {get(APHYLO_PAR_ETA0, -1.0), get(APHYLO_PAR_ETA1, -1.0)};
+  Pi   = get(APHYLO_PAR_PI, -1.0);
+
+  return;
+
+}
+
+inline double AphyloModel::log_prior(const double * par) const {
+
+  if (uniform)
+    return 0.0;
+
+  double ans = 0.0;
+  for (pruner::uint i = 0u; i < npars; ++i)
+    ans += log_dbeta(par[i], shape1[i], shape2[i]);
+
+  return ans;
+
+}
+
+inline double AphyloModel::log_likelihood(
+    AphyloPruner & tree,
+    TreeData & W,
+    const pruner::v_dbl & psi,
+    const pruner::v_dbl & mu_d,
+    const pruner::v_dbl & mu_s,
+    const pruner::v_dbl & eta,
+    double Pi,
+    int nthreads_
+) const {
+
+  W.set_factorized(factorized);
+  W.set_scaling(scaling);
+  W.set_reduced(reduced);
+  W.set_params(mu_d, mu_s, psi, eta, Pi);
+
+  if (nthreads_ > 1)
+    W.set_nthreads(nthreads_);
+
+  tree.update(W, nthreads_);
+  return W.ll;
+
+}
+
+inline double AphyloModel::log_likelihood(
+    pruner::uint i,
+    std::vector< TreeData * > & W,
+    const pruner::v_dbl & psi,
+    const pruner::v_dbl & mu_d,
+    const pruner::v_dbl & mu_s,
+    const pruner::v_dbl & eta,
+    double Pi,
+    int nthreads_,
+    bool by_columns
+) const {
+
+  if (!by_columns || !columns.split(i))
+    return log_likelihood(
+      *trees[i], *W[i], psi, mu_d, mu_s, eta, Pi, nthreads_
+      );
+
+  double ans = 0.0;
+  for (pruner::uint k = columns.first[i]; k < columns.first[i + 1u]; ++k)
+    ans += columns.counts[k] * log_likelihood(
+      *columns.columns[k], *W[trees.size() + k], psi, mu_d, mu_s, eta, Pi,
+      nthreads_
+      );
+
+  return ans;
+
+}
+
+inline double AphyloModel::log_likelihood(
+    const double * par,
+    std::vector< TreeData * > & W
+) const {
+
+  pruner::v_dbl psi, mu_d, mu_s, eta;
+  double Pi;
+  get_params(par, psi, mu_d, mu_s, eta, Pi);
+
+  // Identical trees are added in the same order
+  bool use_dedup   = dedup.valid(trees);
+  bool use_columns = columns.valid(trees);
+  pruner::v_dbl ll(trees.size());
+
+  double ans = 0.0;
+  for (pruner::uint i = 0u; i < trees.size(); ++i) {
+
+    if (use_dedup && (dedup.rep[i] != i))
+      ll[i] = ll[dedup.rep[i]];
+    else
+      ll[i] = log_likelihood(
+        i, W, psi, mu_d, mu_s, eta, Pi, nthreads, use_columns
+        );
+
+    ans += ll[i];
+
+  }
+
+  return ans;
+
+}
+
+inline double AphyloModel::operator()(
+    const double * par,
+    std::vector< TreeData * > & W
+) const {
+
+  double ans = log_likelihood(par, W) + log_prior(par);
+
+  // Same as in aphylo_call()$fun
+  if (!std::isfinite(ans))
+    ans = -std::numeric_limits< double >::max() * 1e-10;
+
+  return ans;
+
+}
+
+inline std::vector< TreeData * > AphyloModel::workspaces() const {
+
+  std::vector< TreeData * > ans;
+  ans.reserve(trees.size() + columns.columns.size());
+  for (auto t = trees.begin(); t != trees.end(); ++t)
+    ans.push_back(&(*t)->D);
+
+  for (auto t = columns.columns.begin(); t != columns.columns.end(); ++t)
+    ans.push_back(&(*t)->D);
+
+  return ans;
+
+}
+
+inline std::vector< std::unique_ptr< TreeData > > AphyloModel::acquire() const {
+
+  std::vector< std::unique_ptr< TreeData > > ans;
+  ans.reserve(trees.size() + columns.columns.size());
+  for (auto t = trees.begin(); t != trees.end(); ++t)
+    ans.push_back((*t)->acquire());
+
+  for (auto t = columns.columns.begin(); t != columns.columns.end(); ++t)
+    ans.push_back((*t)->acquire());
+
+  return ans;
+
+}
+
+inline void AphyloModel::release(
+    std::vector< std::unique_ptr< TreeData > > & W
+) const {
+
+  for (pruner::uint i = 0u; i < W.size(); ++i)
+    if (i < trees.size())
+      trees[i]->release(std::move(W[i]));
+    else
+      columns.columns[i - trees.size()]->release(std::move(W[i]));
+
+  W.clear();
+  return;
+
+}
+
+#endif
@@ -2,6 +2,22 @@
 #include "pruner.hpp"
 #include "TreeData.hpp" // TreeData definition
 #include "loglikelihood.h"
+#include "loglikelihood_batch.h"
+#include "loglikelihood_gradient.h"
+#include "loglikelihood_pool.h"
+#include "aphylo_model.h"
+#include "aphylo_hier.h"
+#include <Rversion.h>
+#if R_VERSION < R_Version(3, 6, 0)
+// R 3.5 used `class` as an argument name in Altrep.h
+#define class klass
+extern "C" {
+#include <R_ext/Altrep.h>
+}
+#undef class
+#else
+#include <R_ext/Altrep.h>
+#endif
 using namespace Rcpp;
 
 // #define DEBUG_LIKELIHOOD
@@ -13,13 +29,17 @@ SEXP new_aphylo_pruner_cpp(
     const std::vector< std::vector< unsigned int > > & edgelist,
     const std::vector< std::vector< unsigned int > > & A,
     const std::vector< unsigned int >  & types,
-    unsigned int nannotated
+    unsigned int nannotated,
+    double max_memory = 16.0
 ) {
   
-  // Initializing the tree
+  // Initializing the tree. The memory budget is in GB (see TreeData::init_Pr)
   pruner::uint res;
   Rcpp::XPtr< AphyloPruner > xptr(
-      new AphyloPruner(A, types, nannotated, edgelist[0], edgelist[1], res),
+      new AphyloPruner(
+        A, types, nannotated, edgelist[0], edgelist[1], res,
+        max_memory * 1073741824.0
+      ),
       true);
   
   if (res != 0u)
@@ -45,6 +65,134 @@ int sizeof_pruner(SEXP ptr) {
   return ans;
 }
 
+// Views of TreeData::Pr -------------------------------------------------------
+
+// R sees an n x nstates (column-major) matrix while Pr is stored by rows, so
+// the view maps each element instead of copying the buffer. The view holds a
+// reference to the buffer (see StateMatrix::share), and is only copied into a
+// regular R matrix (data2) if R asks for a pointer to the data.
+struct PrView {
+  std::shared_ptr< const v_dbl_aligned > data;
+  std::shared_ptr< const pruner::v_uint > rowmap;
+  R_xlen_t nrow, ncol;
+};
+
+static R_altrep_class_t Pr_view_class;
+
+inline const PrView * Pr_view_get(SEXP x) {
+  return static_cast< const PrView * >(R_ExternalPtrAddr(R_altrep_data1(x)));
+}
+
+static void Pr_view_finalize(SEXP xp) {
+  delete static_cast< PrView * >(R_ExternalPtrAddr(xp));
+  R_ClearExternalPtr(xp);
+}
+
+static R_xlen_t Pr_view_length(SEXP x) {
+  const PrView * v = Pr_view_get(x);
+  return v->nrow * v->ncol;
+}
+
+static double Pr_view_elt(SEXP x, R_xlen_t k) {
+  
+  SEXP m = R_altrep_data2(x);
+  if (m != R_NilValue)
+    return REAL(m)[k];
+  
+  // Row in the buffer (see StateMatrix)
+  const PrView * v = Pr_view_get(x);
+  std::size_t i = (std::size_t) (k % v->nrow);
+  if (v->rowmap)
+    i = (*v->rowmap)[i];
+  
+  return (*v->data)[i * v->ncol + (std::size_t) (k / v->nrow)];
+  
+}
+
+static R_xlen_t Pr_view_get_region(
+    SEXP x, R_xlen_t i, R_xlen_t n, double * buf
+) {
+  
+  R_xlen_t ncopy = std::min(n, Pr_view_length(x) - i);
+  for (R_xlen_t k = 0; k < ncopy; ++k)
+    buf[k] = Pr_view_elt(x, i + k);
+  
+  return ncopy;
+  
+}
+
+static void * Pr_view_dataptr(SEXP x, Rboolean) {
+  
+  SEXP m = R_altrep_data2(x);
+  if (m == R_NilValue) {
+    
+    R_xlen_t N = Pr_view_length(x);
+    m = PROTECT(Rf_allocVector(REALSXP, N));
+    Pr_view_get_region(x, 0, N, REAL(m));
+    R_set_altrep_data2(x, m);
+    UNPROTECT(1);
+    
+  }
+  
+  return REAL(m);
+  
+}
+
+static const void * Pr_view_dataptr_or_null(SEXP x) {
+  SEXP m = R_altrep_data2(x);
+  return (m == R_NilValue) ? nullptr : REAL(m);
+}
+
+// [[Rcpp::init]]
+void init_Pr_view(DllInfo * dll) {
+  
+  Pr_view_class = R_make_altreal_class("Pr_view", "aphylo", dll);
+  R_set_altrep_Length_method(Pr_view_class, Pr_view_length);
+  R_set_altvec_Dataptr_method(Pr_view_class, Pr_view_dataptr);
+  R_set_altvec_Dataptr_or_null_method(Pr_view_class, Pr_view_dataptr_or_null);
+  R_set_altreal_Elt_method(Pr_view_class, Pr_view_elt);
+  R_set_altreal_Get_region_method(Pr_view_class, Pr_view_get_region);
+  
+  return;
+  
+}
+
+inline SEXP Pr_view(const StateMatrix & Pr) {
+  
+  SEXP xp = PROTECT(R_MakeExternalPtr(
+    new PrView{
+      Pr.share(), Pr.share_rowmap(), (R_xlen_t) Pr.nrows(),
+      (R_xlen_t) Pr.ncols()
+    },
+    R_NilValue, R_NilValue
+  ));
+  R_RegisterCFinalizerEx(xp, Pr_view_finalize, TRUE);
+  
+  SEXP ans = PROTECT(R_new_altrep(Pr_view_class, xp, R_NilValue));
+  SEXP dim = PROTECT(Rf_allocVector(INTSXP, 2));
+  INTEGER(dim)[0] = (int) Pr.nrows();
+  INTEGER(dim)[1] = (int) Pr.ncols();
+  Rf_setAttrib(ans, R_DimSymbol, dim);
+  
+  UNPROTECT(3);
+  return ans;
+  
+}
+
+// Scaling mode from its name (see TreeData.hpp)
+inline pruner::uint scaling_mode(const std::string & scaling) {
+  
+  if (scaling == "rescale")
+    return APHYLO_SCALING_RESCALE;
+  else if (scaling == "log")
+    return APHYLO_SCALING_LOG;
+  else if (scaling == "none")
+    return APHYLO_SCALING_NONE;
+  
+  stop("-scaling- should be either \"rescale\", \"log\", or \"none\".");
+  
+}
+
 // [[Rcpp::export(name = ".LogLike_pruner", rng = false)]]
 List LogLike_pruner(
     SEXP tree_ptr,
@@ -54,42 +202,294 @@ List LogLike_pruner(
     const std::vector< double > & eta,
     const double & Pi,
     bool verb = true,
-    bool check_dims = false
+    bool check_dims = false,
+    bool factorized = false,
+    std::string scaling = "rescale",
+    int nthreads = 1,
+    bool gradient = false,
+    bool reduced_pseq = true
 ) {
   Rcpp::XPtr< AphyloPruner > p(tree_ptr);
   
+  // Which kernel to use for the interior nodes
+  p->args->set_factorized(factorized);
+  
+  // How to avoid underflow
+  p->args->set_scaling(scaling_mode(scaling));
+  
+  // Whether to skip the nodes without annotated tips below
+  p->args->set_reduced(reduced_pseq);
+  
   // Setting the parameters
-  p->args->set_mu_d(mu_d);
-  p->args->set_mu_s(mu_s);
-  p->args->set_psi(psi);
-  
-  p->args->set_eta(eta);
-  
-  // In the case of Pi, if it is negative, then it means that we are using
-  // the stationary value of the transition probabilities.
-  if (Pi < 0.0) {
-    p->args->set_pi(
-        (1 - p->args->prop_type_d)* mu_s[0]/(mu_s[0] + mu_s[1]) +
-          p->args->prop_type_d * mu_d[0]/(mu_d[0] + mu_d[1])
-    );
-  } else 
-    p->args->set_pi(Pi);
+  p->args->set_params(mu_d, mu_s, psi, eta, Pi);
+  
+  // Calculating likelihood using Felsestein's algorithm. Only the nodes
+  // affected by changes since the last call are recomputed.
+  if (nthreads > 1)
+    p->args->set_nthreads(nthreads);
   
-  // Calculating likelihood using Felsestein's algorithm.
-  p->prune_postorder();
+  p->update(nthreads);
   
+  List ans;
   if (verb) {
-    NumericMatrix Pr(p->args->n, p->args->nstates);
-    for (unsigned int i = 0u; i < p->args->n; ++i)
-      for (unsigned int j = 0u; j < p->args->nstates; ++j)
-        Pr(i, j) = p->args->Pr[i][j];
-    
-    return List::create(
-      _["Pr"] = List::create(Pr),
+    // Not a copy: later calls don't modify it (see StateMatrix::detach)
+    ans = List::create(
+      _["Pr"] = List::create(Pr_view(p->args->Pr)),
       _["ll"] = wrap(p->args->ll)
       );
   } else
-    return List::create(_["ll"] = wrap(p->args->ll));
+    ans = List::create(_["ll"] = wrap(p->args->ll));
+  
+  // Exact gradient through a PREORDER pass (see loglikelihood_gradient.h)
+  if (gradient) {
+    std::vector< double > grad;
+    ::gradient(*p, grad, Pi < 0.0);
+    
+    NumericVector grad_r = wrap(grad);
+    grad_r.attr("names") = CharacterVector::create(
+      "psi0", "psi1", "mu_d0", "mu_d1", "mu_s0", "mu_s1", "eta0", "eta1", "Pi"
+    );
+    ans.push_back(grad_r, "gradient");
+  }
+  
+  return ans;
+}
+
+// [[Rcpp::export(name = ".new_aphylo_pruner_pool", rng = false)]]
+SEXP new_aphylo_pruner_pool(const List & trees) {
+  
+  std::vector< AphyloPruner * > ptrs;
+  ptrs.reserve(trees.size());
+  for (int i = 0; i < trees.size(); ++i) {
+    
+    if (!Rf_inherits(trees[i], "aphylo_pruner"))
+      stop("All the elements of -trees- should be of class aphylo_pruner.");
+    
+    Rcpp::XPtr< AphyloPruner > p(trees[i]);
+    ptrs.push_back(p.get());
+    
+  }
+  
+  // The list of trees is kept alive by the pool (prot)
+  Rcpp::XPtr< AphyloPrunerPool > xptr(
+      new AphyloPrunerPool(ptrs), true, R_NilValue, trees
+  );
+  
+  xptr.attr("class") = "aphylo_pruner_pool";
+  
+  return xptr;
+}
+
+/**@brief Whether the pool has the trees in `trees`, in the same order.
+ * 
+ * The pool of a `multiAphylo_pruner` is kept when its elements are replaced
+ * (e.g., with `[[<-`), in which case it would still have the old trees.
+ */
+// [[Rcpp::export(name = ".aphylo_pruner_pool_valid", rng = false)]]
+bool aphylo_pruner_pool_valid(SEXP pool_ptr, const List & trees) {
+  
+  Rcpp::XPtr< AphyloPrunerPool > p(pool_ptr);
+  
+  if (p->trees.size() != (pruner::uint) trees.size())
+    return false;
+  
+  for (int i = 0; i < trees.size(); ++i) {
+    
+    if (!Rf_inherits(trees[i], "aphylo_pruner"))
+      return false;
+    
+    Rcpp::XPtr< AphyloPruner > tree(trees[i]);
+    if (tree.get() != p->trees[i])
+      return false;
+    
+  }
+  
+  return true;
+  
+}
+
+/**@brief Sum of the log-likelihoods of the trees in a pool.
+ * 
+ * Same as adding up the `ll` returned by `.LogLike_pruner()` for each tree,
+ * but the trees are computed in parallel (see AphyloPrunerPool::update).
+ */
+// [[Rcpp::export(name = ".LogLike_pruner_pool", rng = false)]]
+double LogLike_pruner_pool(
+    SEXP pool_ptr,
+    const std::vector< double > & mu_d,
+    const std::vector< double > & mu_s,
+    const std::vector< double > & psi,
+    const std::vector< double > & eta,
+    const double & Pi,
+    bool factorized = false,
+    std::string scaling = "rescale",
+    int nthreads = 1,
+    bool reduced_pseq = true
+) {
+  
+  Rcpp::XPtr< AphyloPrunerPool > p(pool_ptr);
+  
+  p->set_factorized(factorized);
+  p->set_scaling(scaling_mode(scaling));
+  p->set_reduced(reduced_pseq);
+  p->set_params(mu_d, mu_s, psi, eta, Pi);
+  
+  return p->update(nthreads);
+  
+}
+
+/**@brief Compiled version of the objective function of a model.
+ * 
+ * `trees` is a list of `aphylo_pruner` objects, and `par_names` the names of
+ * the free parameters, in the order in which they will be passed to
+ * `.aphylo_model_eval()` (see AphyloModel).
+ */
+// [[Rcpp::export(name = ".new_aphylo_model", rng = false)]]
+SEXP new_aphylo_model(
+    const List & trees,
+    const std::vector< std::string > & par_names,
+    const std::vector< double > & shape1,
+    const std::vector< double > & shape2,
+    bool uniform,
+    bool factorized = false,
+    std::string scaling = "rescale",
+    int nthreads = 1,
+    bool reduced_pseq = true
+) {
+  
+  std::vector< AphyloPruner * > ptrs;
+  ptrs.reserve(trees.size());
+  for (int i = 0; i < trees.size(); ++i) {
+    
+    if (!Rf_inherits(trees[i], "aphylo_pruner"))
+      stop("All the elements of -trees- should be of class aphylo_pruner.");
+    
+    Rcpp::XPtr< AphyloPruner > p(trees[i]);
+    ptrs.push_back(p.get());
+    
+  }
+  
+  // The list of trees is kept alive by the model (prot)
+  Rcpp::XPtr< AphyloModel > xptr(
+      new AphyloModel(
+        ptrs, par_names, shape1, shape2, uniform, factorized,
+        scaling_mode(scaling), nthreads, reduced_pseq
+      ),
+      true, R_NilValue, trees
+  );
+  xptr.attr("class") = "aphylo_model";
+  
+  return xptr;
+  
+}
+
+// [[Rcpp::export(name = ".aphylo_model_eval", rng = false)]]
+double aphylo_model_eval(SEXP model_ptr, const std::vector< double > & p) {
+  
+  Rcpp::XPtr< AphyloModel > model(model_ptr);
+  
+  if (p.size() != model->npars)
+    stop("-p- should have %i parameters.", model->npars);
+  
+  std::vector< TreeData * > W = model->workspaces();
+  return (*model)(&p[0u], W);
+  
+}
+
+/**@brief Compiled version of the joint log-posterior of a hierarchical model.
+ * 
+ * `classes` (0-based) assigns each tree in `trees` to a class, `pos` lists the
+ * positions (0-based) of the parameters of each class in the vector passed to
+ * `.aphylo_hier_eval()`, and `alpha_pos` and `beta_pos` those of the shapes of
+ * the hyperprior of each parameter (see AphyloHierModel).
+ */
+// [[Rcpp::export(name = ".new_aphylo_hier_model", rng = false)]]
+SEXP new_aphylo_hier_model(
+    const List & trees,
+    const std::vector< unsigned int > & classes,
+    const std::vector< std::string > & par_names,
+    const std::vector< std::vector< unsigned int > > & pos,
+    const std::vector< unsigned int > & alpha_pos,
+    const std::vector< unsigned int > & beta_pos,
+    unsigned int npars,
+    bool factorized = false,
+    std::string scaling = "rescale",
+    int nthreads = 1,
+    bool reduced_pseq = true
+) {
+  
+  std::vector< AphyloPruner * > ptrs;
+  ptrs.reserve(trees.size());
+  for (int i = 0; i < trees.size(); ++i) {
+    
+    if (!Rf_inherits(trees[i], "aphylo_pruner"))
+      stop("All the elements of -trees- should be of class aphylo_pruner.");
+    
+    Rcpp::XPtr< AphyloPruner > p(trees[i]);
+    ptrs.push_back(p.get());
+    
+  }
+  
+  // The list of trees is kept alive by the model (prot)
+  Rcpp::XPtr< AphyloHierModel > xptr(
+      new AphyloHierModel(
+        ptrs, classes, par_names, pos, alpha_pos, beta_pos, npars,
+        factorized, scaling_mode(scaling), nthreads, reduced_pseq
+      ),
+      true, R_NilValue, trees
+  );
+  xptr.attr("class") = "aphylo_hier_model";
+  
+  return xptr;
+  
+}
+
+// [[Rcpp::export(name = ".aphylo_hier_eval", rng = false)]]
+double aphylo_hier_eval(SEXP model_ptr, const std::vector< double > & p) {
+  
+  Rcpp::XPtr< AphyloHierModel > model(model_ptr);
+  
+  if (p.size() != model->npars)
+    stop("-p- should have %i parameters.", model->npars);
+  
+  return (*model)(&p[0u]);
+  
+}
+
+// [[Rcpp::export(name = ".LogLike_pruner_batch", rng = false)]]
+std::vector< double > LogLike_pruner_batch(
+    SEXP tree_ptr,
+    const NumericMatrix & par,
+    bool factorized = false,
+    std::string scaling = "rescale",
+    bool reduced_pseq = true
+) {
+  Rcpp::XPtr< AphyloPruner > p(tree_ptr);
+  
+  if (par.ncol() != (int) APHYLO_NPARS)
+    stop("-par- should have %i columns (see APHYLO_PARAM_NAMES).", APHYLO_NPARS);
+  
+  // The log scale is not supported in batches (see TreeDataBatch::prune)
+  pruner::uint scaling_ = scaling_mode(scaling);
+  if (scaling_ == APHYLO_SCALING_LOG)
+    stop("-scaling- should be either \"rescale\" or \"none\".");
+  
+  // Each row of -par- is a set of parameters
+  pruner::uint K = (pruner::uint) par.nrow();
+  TreeDataBatch B(p->args->n, p->args->nfuns, K);
+  
+  double row[APHYLO_NPARS];
+  for (pruner::uint k = 0u; k < K; ++k) {
+    for (pruner::uint j = 0u; j < APHYLO_NPARS; ++j)
+      row[j] = par(k, j);
+    
+    B.set_params(&row[0u], k, p->args->prop_type_d);
+  }
+  
+  // Calculating the K likelihoods in a single pass
+  B.prune(*p, factorized, scaling_, reduced_pseq);
+  
+  return B.ll;
 }
 
 // [[Rcpp::export(rng = false)]]
@@ -196,7 +596,7 @@ unsigned int Tree_set_ann(const SEXP & phy, unsigned int i, unsigned int j, unsi
   
   Rcpp::XPtr< AphyloPruner > p(phy);
   
-  p->args->set_ann(i, j, val);
+  p->set_ann(i, j, val);
   
   return 0u;
   
@@ -206,7 +606,16 @@ unsigned int Tree_set_ann(const SEXP & phy, unsigned int i, unsigned int j, unsi
 std::vector< std::vector< unsigned int > > Tree_get_ann(const SEXP & phy) {
   
   Rcpp::XPtr< AphyloPruner > p(phy);
-  return p->args->A;
+  return p->args->A.as_vv_uint();
+  
+}
+
+// Number of nodes pruned by the last call (for testing the partial updates)
+// [[Rcpp::export]]
+unsigned int Tree_get_nupdated(const SEXP & phy) {
+  
+  Rcpp::XPtr< AphyloPruner > p(phy);
+  return p->args->nupdated;
   
 }
 
@@ -0,0 +1,373 @@
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <memory>
+#include <stdexcept>
+#include "pruner.hpp"
+
+#ifndef APHYLO_FLAT_STORAGE_HPP
+#define APHYLO_FLAT_STORAGE_HPP 1
+
+// Alignment (in bytes) of the flat buffers. 64 is the size of a cache line in
+// most architectures and is enough for AVX-512 loads.
+#ifndef APHYLO_ALIGNMENT
+#define APHYLO_ALIGNMENT 64u
+#endif
+
+//! Fixed size 2x2 matrix used for the transition/misclassification matrices
+typedef std::array< std::array< double, 2u >, 2u > mat22;
+
+//! Probability of each annotation (0, 1, or missing) of a tip as a function
+//! of its state (see TreeData::set_tip_pr)
+typedef std::array< std::array< double, 3u >, 2u > mat23;
+
+/**@brief Minimal allocator returning `APHYLO_ALIGNMENT`-aligned memory.
+ *
+ * It over-allocates and keeps the original address right before the aligned
+ * block, so it does not depend on C++17's aligned `new`.
+ */
+template <class T>
+class AlignedAllocator {
+public:
+
+  typedef T value_type;
+
+  AlignedAllocator() {};
+  template <class U> AlignedAllocator(const AlignedAllocator< U > &) {};
+
+  T * allocate(std::size_t n) {
+
+    std::size_t nbytes = n * sizeof(T) + APHYLO_ALIGNMENT + sizeof(void*);
+    void * raw = ::operator new(nbytes);
+
+    std::uintptr_t start = reinterpret_cast< std::uintptr_t >(raw) + sizeof(void*);
+    std::uintptr_t aligned = (start + APHYLO_ALIGNMENT - 1u) &
+      ~static_cast< std::uintptr_t >(APHYLO_ALIGNMENT - 1u);
+
+    reinterpret_cast< void** >(aligned)[-1] = raw;
+
+    return reinterpret_cast< T* >(aligned);
+
+  }
+
+  void deallocate(T * p, std::size_t) {
+    ::operator delete(reinterpret_cast< void** >(p)[-1]);
+  }
+
+  template <class U> struct rebind {typedef AlignedAllocator< U > other;};
+
+};
+
+template <class T, class U>
+inline bool operator==(const AlignedAllocator< T > &, const AlignedAllocator< U > &) {
+  return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const AlignedAllocator< T > &, const AlignedAllocator< U > &) {
+  return false;
+}
+
+typedef std::vector< double, AlignedAllocator< double > > v_dbl_aligned;
+
+/**@brief Node x state matrix stored as a single aligned row-major buffer.
+ *
+ * `Pr[i]` returns a pointer to the i-th row, so `Pr[i][s]` keeps working as it
+ * did with `vector< vector< double > >`, but the rows are contiguous in memory.
+ *
+ * In the compact layout, only the rows listed at construction are stored,
+ * and all other rows point to a single shared row (the last one). This is
+ * used for nodes that are never written to, e.g., tips excluded from the
+ * pruning sequence, which keep the value used to initialize the matrix.
+ *
+ * The buffer can be shared with read-only views (see share()), e.g., the
+ * matrices returned to R by `LogLike()`. Before writing into the matrix,
+ * detach() gives it its own copy if a view is still alive, so views never see
+ * later changes.
+ */
+class StateMatrix {
+private:
+  pruner::uint nrow, ncol;
+  std::shared_ptr< v_dbl_aligned > data;
+  std::shared_ptr< const pruner::v_uint > rowmap;
+  double * buf;
+  const pruner::uint * map;
+
+  std::size_t row(pruner::uint i) const {
+    return (std::size_t) (map ? map[i] : i) * ncol;
+  };
+
+public:
+
+  StateMatrix() : nrow(0u), ncol(0u),
+    data(std::make_shared< v_dbl_aligned >()), buf(data->data()),
+    map(nullptr) {};
+  StateMatrix(pruner::uint nrow_, pruner::uint ncol_, double val = 0.0) :
+    nrow(nrow_), ncol(ncol_),
+    data(std::make_shared< v_dbl_aligned >((std::size_t) nrow_ * ncol_, val)),
+    buf(data->data()), map(nullptr) {};
+  StateMatrix(
+    const pruner::v_uint & rows, pruner::uint nrow_, pruner::uint ncol_,
+    double val = 0.0
+  );
+  StateMatrix(const StateMatrix & M) : nrow(M.nrow), ncol(M.ncol),
+    data(std::make_shared< v_dbl_aligned >(*M.data)), rowmap(M.rowmap),
+    buf(data->data()), map(M.map) {};
+  StateMatrix(StateMatrix && M) = default;
+  StateMatrix & operator=(const StateMatrix & M) {
+    if (this != &M)
+      *this = StateMatrix(M);
+    return *this;
+  };
+  StateMatrix & operator=(StateMatrix && M) = default;
+  ~StateMatrix() {};
+
+  double * operator[](pruner::uint i) {return buf + row(i);};
+  const double * operator[](pruner::uint i) const {return buf + row(i);};
+
+  double & operator()(pruner::uint i, pruner::uint j) {
+    return buf[row(i) + j];
+  };
+
+  double operator()(pruner::uint i, pruner::uint j) const {
+    return buf[row(i) + j];
+  };
+
+  pruner::uint size() const {return nrow;};
+  pruner::uint nrows() const {return nrow;};
+  pruner::uint ncols() const {return ncol;};
+  double * ptr() {return buf;};
+  const double * ptr() const {return buf;};
+
+  //! Number of doubles actually stored
+  std::size_t nelem() const {return data->size();};
+
+  //! Row of each node in the buffer (null if not compact)
+  std::shared_ptr< const pruner::v_uint > share_rowmap() const {return rowmap;};
+
+  //! Read-only handle to the buffer, which stays valid after detach()
+  std::shared_ptr< const v_dbl_aligned > share() const {return data;};
+
+  //! Copies the buffer if it is shared with a view (copy-on-write)
+  void detach() {
+    if (data.use_count() > 1) {
+      data = std::make_shared< v_dbl_aligned >(*data);
+      buf  = data->data();
+    }
+    return;
+  };
+
+};
+
+inline StateMatrix::StateMatrix(
+    const pruner::v_uint & rows, pruner::uint nrow_, pruner::uint ncol_,
+    double val
+) : nrow(nrow_), ncol(ncol_) {
+
+  // All the nodes not in -rows- share the last row
+  std::shared_ptr< pruner::v_uint > rowmap_ =
+    std::make_shared< pruner::v_uint >(nrow_, (pruner::uint) rows.size());
+  for (pruner::uint k = 0u; k < rows.size(); ++k)
+    (*rowmap_)[rows[k]] = k;
+
+  rowmap = rowmap_;
+  map    = rowmap->data();
+  data   = std::make_shared< v_dbl_aligned >(
+    ((std::size_t) rows.size() + 1u) * ncol_, val
+  );
+  buf    = data->data();
+
+  return;
+
+}
+
+/**@brief Matrix of states as a function of the state index.
+ *
+ * The set of 2^P states is enumerated so that the p-th bit of the index is the
+ * state of the p-th function, hence there is no need to store the matrix:
+ * `states[s][p]` is just `(s >> p) & 1`.
+ */
+class StateBits {
+private:
+  pruner::uint P, nstates;
+
+public:
+
+  class Row {
+  private:
+    pruner::uint s, P;
+  public:
+    Row(pruner::uint s_, pruner::uint P_) : s(s_), P(P_) {};
+    pruner::uint operator[](pruner::uint p) const {return (s >> p) & 1u;};
+    pruner::uint size() const {return P;};
+  };
+
+  StateBits() : P(0u), nstates(1u) {};
+  StateBits(pruner::uint P_) : P(P_), nstates(1u << P_) {};
+  ~StateBits() {};
+
+  Row operator[](pruner::uint s) const {return Row(s, P);};
+  pruner::uint size() const {return nstates;};
+  pruner::uint nfuns() const {return P;};
+
+};
+
+/**@brief Bit-packed matrix of annotations (0, 1, or 9 for missing).
+ *
+ * Each row (node) is stored as two sets of 64-bit words: the first flags
+ * whether the function is annotated (i.e., not 9), and the second its value.
+ * `A[i][j]` returns the annotation as an unsigned int as before.
+ */
+class AnnotationMatrix {
+private:
+  pruner::uint nrow, ncol, nwords;
+  std::vector< std::uint64_t > annotated, value;
+
+  std::size_t word(pruner::uint i, pruner::uint j) const {
+    return (std::size_t) i * nwords + (j >> 6u);
+  };
+
+public:
+
+  class Row {
+  private:
+    const AnnotationMatrix * A;
+    pruner::uint i;
+  public:
+    Row(const AnnotationMatrix * A_, pruner::uint i_) : A(A_), i(i_) {};
+    pruner::uint operator[](pruner::uint j) const {return (*A)(i, j);};
+    pruner::uint size() const {return A->ncols();};
+  };
+
+  AnnotationMatrix() : nrow(0u), ncol(0u), nwords(0u) {};
+  AnnotationMatrix(const pruner::vv_uint & A);
+  ~AnnotationMatrix() {};
+
+  pruner::uint operator()(pruner::uint i, pruner::uint j) const {
+
+    std::uint64_t bit = static_cast< std::uint64_t >(1u) << (j & 63u);
+    if (!(annotated[word(i, j)] & bit))
+      return 9u;
+
+    return (value[word(i, j)] & bit) ? 1u : 0u;
+
+  };
+
+  Row operator[](pruner::uint i) const {return Row(this, i);};
+
+  //! Column of the annotation in a mat23 table: 0, 1, or 2 if missing
+  pruner::uint code(pruner::uint i, pruner::uint j) const {
+
+    std::uint64_t shift = j & 63u;
+    pruner::uint a = (annotated[word(i, j)] >> shift) & 1u;
+    pruner::uint v = (value[word(i, j)] >> shift) & 1u;
+
+    return 2u - a * (2u - v);
+
+  };
+
+  void set(pruner::uint i, pruner::uint j, pruner::uint x);
+
+  //! Whether the i-th row has at least one annotation different from 9
+  bool has_ann(pruner::uint i) const {
+    for (pruner::uint w = 0u; w < nwords; ++w)
+      if (annotated[(std::size_t) i * nwords + w])
+        return true;
+    return false;
+  };
+
+  pruner::uint size() const {return nrow;};
+  pruner::uint nrows() const {return nrow;};
+  pruner::uint ncols() const {return ncol;};
+
+  //! Coerces the data back into a vector of vectors (as passed from R)
+  pruner::vv_uint as_vv_uint() const;
+
+  bool operator==(const AnnotationMatrix & other) const {
+    return (nrow == other.nrow) && (ncol == other.ncol) &&
+      (annotated == other.annotated) && (value == other.value);
+  };
+
+  //! Hash of the annotations (see AphyloPruner::problem_hash)
+  std::size_t hash() const;
+
+};
+
+inline AnnotationMatrix::AnnotationMatrix(const pruner::vv_uint & A) {
+
+  nrow   = A.size();
+  ncol   = (nrow > 0u) ? A[0u].size() : 0u;
+  nwords = (ncol + 63u) / 64u;
+
+  annotated.resize((std::size_t) nrow * nwords, 0u);
+  value.resize((std::size_t) nrow * nwords, 0u);
+
+  for (pruner::uint i = 0u; i < nrow; ++i) {
+
+    if (A[i].size() != ncol)
+      throw std::length_error("All function annotations in A have to have the same length.");
+
+    for (pruner::uint j = 0u; j < ncol; ++j)
+      this->set(i, j, A[i][j]);
+
+  }
+
+  return;
+
+}
+
+inline void AnnotationMatrix::set(pruner::uint i, pruner::uint j, pruner::uint x) {
+
+  std::uint64_t bit = static_cast< std::uint64_t >(1u) << (j & 63u);
+
+  if (x == 9u) {
+    annotated[word(i, j)] &= ~bit;
+    value[word(i, j)]     &= ~bit;
+  } else if (x == 0u) {
+    annotated[word(i, j)] |= bit;
+    value[word(i, j)]     &= ~bit;
+  } else if (x == 1u) {
+    annotated[word(i, j)] |= bit;
+    value[word(i, j)]     |= bit;
+  } else
+    throw std::invalid_argument("Annotations should be either 0, 1, or 9.");
+
+  return;
+
+}
+
+//! Same as boost's hash_combine
+inline void hash_combine(std::size_t & seed, std::size_t x) {
+  seed ^= x + static_cast< std::size_t >(0x9e3779b97f4a7c15ull) + (seed << 6) +
+    (seed >> 2);
+  return;
+}
+
+inline std::size_t AnnotationMatrix::hash() const {
+
+  std::size_t ans = 0u;
+  hash_combine(ans, nrow);
+  hash_combine(ans, ncol);
+  for (std::size_t k = 0u; k < annotated.size(); ++k) {
+    hash_combine(ans, static_cast< std::size_t >(annotated[k]));
+    hash_combine(ans, static_cast< std::size_t >(value[k]));
+  }
+
+  return ans;
+
+}
+
+inline pruner::vv_uint AnnotationMatrix::as_vv_uint() const {
+
+  pruner::vv_uint ans(nrow, pruner::v_uint(ncol));
+  for (pruner::uint i = 0u; i < nrow; ++i)
+    for (pruner::uint j = 0u; j < ncol; ++j)
+      ans[i][j] = (*this)(i, j);
+
+  return ans;
+
+}
+
+#endif
@@ -1,10 +1,204 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <R_ext/BLAS.h>
 #include "pruner.hpp"
 #include "TreeData.hpp" // TreeData definition
 
+#ifndef FCONE
+#define FCONE
+#endif
+
 #ifndef APHYLO_LOGLIKELIHOOD_H
 #define APHYLO_LOGLIKELIHOOD_H 1
 
-void likelihood(
+/**@brief Applies the 2x2 transition matrix `M` to every function in `x`.
+ * 
+ * `x` is a vector of length `nstates = 2^nfuns` indexed as in `StateBits`,
+ * i.e., the p-th bit of the index is the state of the p-th function. Since the
+ * transition probabilities are independent across functions, the 
+ * `nstates x nstates` transition matrix is the kronecker product of `M` with
+ * itself `nfuns` times, so `x` can be contracted one function at a time in
+ * O(nfuns * 2^nfuns) instead of O(nfuns * 4^nfuns). The result is written
+ * back into `x`.
+ */
+inline void kron_transition(
+    const mat22 & M,
+    double * x,
+    pruner::uint nfuns,
+    pruner::uint nstates
+) {
+  
+  double x0, x1;
+  for (pruner::uint p = 0u; p < nfuns; ++p) {
+    
+    // States differing only on the p-th function are `stride` apart
+    pruner::uint stride = 1u << p;
+    for (pruner::uint b = 0u; b < nstates; b += (stride << 1u))
+      for (pruner::uint k = b; k < (b + stride); ++k) {
+        
+        x0 = x[k];
+        x1 = x[k + stride];
+        
+        x[k]          = M[0u][0u] * x0 + M[0u][1u] * x1;
+        x[k + stride] = M[1u][0u] * x0 + M[1u][1u] * x1;
+        
+      }
+    
+  }
+  
+  return;
+  
+}
+
+/**@brief Computes `y = TM x`, with `TM` a row-major `nstates x nstates` matrix.
+ * 
+ * Large matrices go to BLAS's dgemv (as the transpose of a column-major
+ * matrix). Otherwise, each element of `y` is accumulated in the order of the
+ * states, as in the non-tabulated kernel.
+ */
+inline void transition_matvec(
+    const double * TM,
+    const double * x,
+    double * y,
+    pruner::uint nstates
+) {
+  
+  if (nstates >= APHYLO_BLAS_MIN_STATES) {
+    
+    int n = (int) nstates, inc = 1;
+    double one = 1.0, zero = 0.0;
+    F77_CALL(dgemv)(
+      "T", &n, &n, &one, TM, &n, x, &inc, &zero, y, &inc FCONE
+    );
+    
+    return;
+    
+  }
+  
+  for (pruner::uint s = 0u; s < nstates; ++s) {
+    
+    const double * row = TM + (std::size_t) s * nstates;
+    double ans = 0.0;
+    for (pruner::uint s_n = 0u; s_n < nstates; ++s_n)
+      ans += row[s_n] * x[s_n];
+    
+    y[s] = ans;
+    
+  }
+  
+  return;
+  
+}
+
+//! log(exp(a) + exp(b)) without overflow/underflow
+inline double log_add_exp(double a, double b) {
+  
+  if (a < b)
+    std::swap(a, b);
+  
+  if (a == -std::numeric_limits< double >::infinity())
+    return a;
+  
+  return a + std::log1p(std::exp(b - a));
+  
+}
+
+//! Same as kron_transition, but `x` and `logM` are in the log scale.
+inline void kron_transition_log(
+    const mat22 & logM,
+    double * x,
+    pruner::uint nfuns,
+    pruner::uint nstates
+) {
+  
+  double x0, x1;
+  for (pruner::uint p = 0u; p < nfuns; ++p) {
+    
+    pruner::uint stride = 1u << p;
+    for (pruner::uint b = 0u; b < nstates; b += (stride << 1u))
+      for (pruner::uint k = b; k < (b + stride); ++k) {
+        
+        x0 = x[k];
+        x1 = x[k + stride];
+        
+        x[k]          = log_add_exp(logM[0u][0u] + x0, logM[0u][1u] + x1);
+        x[k + stride] = log_add_exp(logM[1u][0u] + x0, logM[1u][1u] + x1);
+        
+      }
+    
+  }
+  
+  return;
+  
+}
+
+/**@brief Rescales the i-th row of `Pr` if its largest element is too small.
+ * 
+ * The row is multiplied by a power of two so that its maximum falls in
+ * [0.5, 1). Since the factor is a power of two the operation is exact, and
+ * the log of the factor is accumulated in `Pr_lscale[i]`.
+ */
+inline void rescale_row(TreeData * D, pruner::uint i) {
+  
+  double * row = D->Pr[i];
+  double m = *std::max_element(row, row + D->nstates);
+  if ((m >= APHYLO_SCALING_THRESHOLD) || !(m > 0.0))
+    return;
+  
+  int e;
+  std::frexp(m, &e);
+  double factor = std::ldexp(1.0, -e);
+  for (pruner::uint s = 0u; s < D->nstates; ++s)
+    row[s] *= factor;
+  
+  D->Pr_lscale[i] -= (double) e * APHYLO_LN2;
+  
+  return;
+  
+}
+
+// Copies the i-th row of Pr in the probability scale. Rows are only needed up
+// to a constant, so in the log scale these are rescaled to have max 1.
+inline void pr_row(const TreeData & D, pruner::uint i, double * x) {
+  
+  std::copy(D.Pr[i], D.Pr[i] + D.nstates, x);
+  if (D.scaling != APHYLO_SCALING_LOG)
+    return;
+  
+  double m = *std::max_element(x, x + D.nstates);
+  for (pruner::uint s = 0u; s < D.nstates; ++s)
+    x[s] = (m == -std::numeric_limits< double >::infinity()) ?
+      0.0 : exp(x[s] - m);
+  
+  return;
+  
+}
+
+//! Computes the log-likelihood (`D->ll`) from the probabilities of the root
+inline void root_ll(TreeData * D, pruner::uint root) {
+  
+  if (D->scaling == APHYLO_SCALING_LOG) {
+    
+    D->ll = -std::numeric_limits< double >::infinity();
+    for (pruner::uint s = 0; s < D->nstates; ++s) 
+      D->ll = log_add_exp(D->ll, log(D->Pi[s]) + D->Pr[root][s]);
+    
+  } else {
+    
+    D->ll = 0.0;
+    for (pruner::uint s = 0; s < D->nstates; ++s) 
+      D->ll += D->Pi[s] * D->Pr[root][s];
+    D->ll = log(D->ll) - D->Pr_lscale[root];
+    
+  }
+  
+  return;
+  
+}
+
+inline void likelihood(
     TreeData * D,
     pruner::TreeIterator<TreeData> & n
 ) {
@@ -17,70 +211,146 @@ void likelihood(
   printf("\n");
 #endif
   
+  bool logscale = D->scaling == APHYLO_SCALING_LOG;
+  D->Pr_lscale[*n] = 0.0;
+  
+  // Each thread has its own scratch space (see Tree::prune_postorder_parallel)
+  std::size_t slot = 0u;
+#ifdef _OPENMP
+  slot = (std::size_t) omp_get_thread_num() * D->nstates;
+  if ((slot + D->nstates) > D->Pr_off.size())
+    slot = 0u;
+#endif
+  double * Pr_off = &D->Pr_off[slot];
+  
   if (n.is_tip()) {
     
-    // Iterating through the states
-    pruner::uint s, p;
-    for (s = 0u; s < D->states.size(); ++s) {
+    // The row is the kronecker product of the emission probabilities of each
+    // function (see TreeData::set_tip_pr), so it is built one function at a
+    // time: states with the p-th bit set are `stride` apart from those without
+    // it. Each state still gets its factors multiplied (added) in the order of
+    // the functions. Missing annotations that do not contribute have factor 1
+    // (0 in the log scale).
+    double * row = D->Pr[*n];
+    row[0u] = logscale ? 0.0 : 1.0;
+    for (pruner::uint p = 0u; p < D->nfuns; ++p) {
+      
+      pruner::uint a      = D->A.code(*n, p);
+      pruner::uint stride = 1u << p;
       
-      // Throught the functions
-      D->Pr[*n][s] = 1.0; // Initializing
-      for (p = 0u; p < D->nfuns; ++p) {
+      if (logscale) {
         
-        // ETA PARAMETER
-        if (D->A[*n][p] == 9u && (D->eta[0u] >= 0.0)) {
-          
-          D->Pr[*n][s] *=
-            (1.0 - D->eta[0u]) * D->PSI[D->states[s][p]][0u] +
-            (1.0 - D->eta[1u]) * D->PSI[D->states[s][p]][1u]
-          ;
-          
-        } else {
-          
-          // Unnanotated leafs should be skipped in this situation. This mostly
-          // happens if we are not using the eta parameter and during cv. At
-          // that time some annotations are dropped without modifying the 
-          // pruning sequence.
-          if (D->A[*n][p] == 9u)
-            continue;
-          
-          if (D->eta[0u] >= 0.0) {
-            
-            D->Pr[*n][s] *= D->PSI[D->states[s][p]][D->A[*n][p]]*
-              D->eta[D->A[*n][p]];
-            
-          } else {
-            
-            D->Pr[*n][s] *= D->PSI[D->states[s][p]][D->A[*n][p]];
-            
-          }
-          
+        double f0 = D->tip_lpr[0u][a], f1 = D->tip_lpr[1u][a];
+        for (pruner::uint k = 0u; k < stride; ++k) {
+          row[k + stride] = row[k] + f1;
+          row[k]         += f0;
+        }
+        
+      } else {
+        
+        double f0 = D->tip_pr[0u][a], f1 = D->tip_pr[1u][a];
+        for (pruner::uint k = 0u; k < stride; ++k) {
+          row[k + stride] = row[k] * f1;
+          row[k]         *= f0;
         }
         
       }
       
     }
     
-  } else {
+    if (D->scaling == APHYLO_SCALING_RESCALE)
+      rescale_row(D, *n);
+    
+  } else if (D->factorized) {
+    
+    // Since the transition probabilities factorize across functions, instead
+    // of integrating over the 2^P x 2^P pairs of states we apply the 2x2
+    // transition matrix one function at a time (see kron_transition).
+    const mat22 & M = (D->types[*n] == 0u) ? D->MU_d : D->MU_s;
+    mat22 logM;
+    if (logscale)
+      for (pruner::uint i = 0u; i < 2u; ++i)
+        for (pruner::uint j = 0u; j < 2u; ++j)
+          logM[i][j] = log(M[i][j]);
+    
+    pruner::uint s;
+    std::fill(D->Pr[*n], D->Pr[*n] + D->nstates, logscale ? 0.0 : 1.0);
+    for (auto o_n = n.begin_off(); o_n != n.end_off(); ++o_n) {
+      
+      std::copy(D->Pr[*o_n], D->Pr[*o_n] + D->nstates, Pr_off);
+      
+      // Getting the joint conditional.
+      if (logscale) {
+        
+        kron_transition_log(logM, Pr_off, D->nfuns, D->nstates);
+        for (s = 0u; s < D->nstates; ++s)
+          D->Pr[*n][s] += Pr_off[s];
+        
+      } else {
+        
+        kron_transition(M, Pr_off, D->nfuns, D->nstates);
+        for (s = 0u; s < D->nstates; ++s)
+          D->Pr[*n][s] *= Pr_off[s];
+        
+        D->Pr_lscale[*n] += D->Pr_lscale[*o_n];
+        if (D->scaling == APHYLO_SCALING_RESCALE)
+          rescale_row(D, *n);
+        
+      }
+      
+    }
     
-    D->MU[0] = &(D->MU_d);
-    D->MU[1] = &(D->MU_s);
+  } else {
     
     std::vector< unsigned int >::const_iterator o_n;
     pruner::uint s_n, p_n, s;
-    double offspring_ll, s_n_sum;
+    double offspring_ll, s_n_sum, max_ll;
+    
+    // Transition matrix of the node's type, if tabulated (in the log scale if
+    // logscale, see TreeData::update_transition)
+    const double * TM = nullptr;
+    if (D->TM_d.size())
+      TM = (D->types[*n] == 0u) ? D->TM_d.data() : D->TM_s.data();
+    
+    std::fill(D->Pr[*n], D->Pr[*n] + D->nstates, logscale ? 0.0 : 1.0);
     
-    // Looping through states
-    for (s = 0u; s < D->nstates; ++s) {
+    // Now through offspring
+    for (o_n = n.begin_off(); o_n != n.end_off(); ++o_n) {
+      
+      // A dense matrix-vector product
+      if (TM && !logscale) {
+        
+        transition_matvec(TM, D->Pr[*o_n], Pr_off, D->nstates);
+        for (s = 0u; s < D->nstates; ++s)
+          D->Pr[*n][s] *= Pr_off[s];
+        
+        D->Pr_lscale[*n] += D->Pr_lscale[*o_n];
+        if (D->scaling == APHYLO_SCALING_RESCALE)
+          rescale_row(D, *n);
+        
+        continue;
+        
+      }
       
-      // Now through offspring
-      D->Pr[*n][s] = 1.0;
-      for (o_n = n.begin_off(); o_n != n.end_off(); ++o_n) {
+      // Looping through states
+      for (s = 0u; s < D->nstates; ++s) {
         
         // Offspring state integration
         offspring_ll = 0.0;
+        max_ll       = -std::numeric_limits< double >::infinity();
         for (s_n = 0u; s_n < D->nstates; ++s_n) {
           
+          if (TM) {
+            
+            // Only in the log scale
+            Pr_off[s_n] = TM[(std::size_t) s * D->nstates + s_n] + D->Pr[*o_n][s_n];
+            if (Pr_off[s_n] > max_ll)
+              max_ll = Pr_off[s_n];
+            
+            continue;
+            
+          }
+          
           s_n_sum = 1.0;
           for (p_n = 0u; p_n < D->nfuns; ++p_n)
             // s_n_sum *= (D->MU[D->types[*n]]).at(D->states[s][p_n]).at(D->states[s_n][p_n]);
@@ -88,28 +358,51 @@ void likelihood(
           D->MU_d[D->states[s][p_n]][D->states[s_n][p_n]] :
             D->MU_s[D->states[s][p_n]][D->states[s_n][p_n]];
           
-          // Multiplying by off's probability
-          offspring_ll += (s_n_sum) * D->Pr[*o_n][s_n];
+          if (logscale) {
+            
+            // Keeping the terms to compute the log-sum-exp
+            Pr_off[s_n] = log(s_n_sum) + D->Pr[*o_n][s_n];
+            if (Pr_off[s_n] > max_ll)
+              max_ll = Pr_off[s_n];
+            
+          } else
+            // Multiplying by off's probability
+            offspring_ll += (s_n_sum) * D->Pr[*o_n][s_n];
           
         }
         
         // Getting the joint conditional.
-        D->Pr[*n][s] *= offspring_ll;
+        if (logscale) {
+          
+          if (max_ll == -std::numeric_limits< double >::infinity()) {
+            D->Pr[*n][s] = max_ll;
+            continue;
+          }
+          
+          for (s_n = 0u; s_n < D->nstates; ++s_n)
+            offspring_ll += exp(Pr_off[s_n] - max_ll);
+          
+          D->Pr[*n][s] += max_ll + log(offspring_ll);
+          
+        } else
+          D->Pr[*n][s] *= offspring_ll;
         
       }
       
-    }
-    
-    // Computing the joint likelihood
-    if (*n == n.back()) {
-      D->ll = 0.0;
-      for (s = 0; s < D->nstates; ++s) 
-        D->ll += D->Pi[s] * D->Pr[*n][s];
-      D->ll = log(D->ll);
+      if (!logscale) {
+        D->Pr_lscale[*n] += D->Pr_lscale[*o_n];
+        if (D->scaling == APHYLO_SCALING_RESCALE)
+          rescale_row(D, *n);
+      }
+      
     }
     
   }
   
+  // Computing the joint likelihood
+  if (!n.is_tip() && (*n == n.back()))
+    root_ll(D, *n);
+  
   
   return;
   
@@ -123,97 +416,654 @@ void likelihood(
  * 
  */
 class AphyloPruner: public pruner::Tree<TreeData> {
+private:
+  
+  // Position of each node in the pruning sequence (n if not included), used
+  // by update()
+  pruner::v_uint pseq_pos;
+  
+  // Reduced pruning sequence: the nodes of the postorder with at least one
+  // annotated tip below (`nann_below`), and the same nodes grouped by level
+  // (see get_levels). Since tips without annotations have probability 1
+  // unless eta is used, these can be skipped. The sequence is updated in
+  // place by set_ann(), so it may also have nodes left with no annotated tips
+  // below (`nstale`), which are harmless as their rows are all ones.
+  // `pseq_version` changes every time the sequence is rebuilt.
+  pruner::v_uint pseq_reduced, nann_below, node_level;
+  pruner::vv_uint levels_reduced;
+  std::vector< bool > in_reduced;
+  pruner::uint nstale = 0u;
+  pruner::uint pseq_version = 0u;
+  
+  void set_pseq_reduced();
+  
+  // Parameters on which the probabilities of each node in the pruning
+  // sequence depend (APHYLO_DEP_*), used by update()
+  pruner::v_uint node_deps;
+  
+  // Workspaces returned by release(), reused by acquire()
+  std::vector< std::unique_ptr< TreeData > > workspaces;
+  std::mutex workspaces_mutex;
+  
 public:
   
+  //! Default workspace, used by the R interface
   TreeData D;
   
+  //! Computes the likelihood using the workspace `W` (see TreeData)
+  void update(TreeData & W, int nthreads = 1);
+  void update(int nthreads = 1) {return update(D, nthreads);};
+  
+  //! Whether `W` is pruned using the reduced pruning sequence, i.e., if
+  //! requested (see TreeData::set_reduced), eta is not used, and at least
+  //! one tip is annotated
+  bool use_reduced(const TreeData & W) const {
+    return W.reduced && !W.use_eta() && pseq_reduced.size();
+  };
+  
+  //! Either the reduced pruning sequence (if not empty) or the full postorder
+  const pruner::v_uint & get_pseq(bool reduced) const {
+    return (reduced && pseq_reduced.size()) ?
+      pseq_reduced : *this->get_postorder_ptr();
+  };
+  const pruner::v_uint & get_pseq(const TreeData & W) const {
+    return get_pseq(use_reduced(W));
+  };
+  
+  //! Sets an annotation of `D` (see TreeData::set_ann), updating the number
+  //! of annotated tips below its ancestors, and the reduced pruning sequence
+  //! if the tip gained its first or lost its last annotation
+  void set_ann(pruner::uint i, pruner::uint j, pruner::uint x);
+  
+  //! Returns a workspace to be used with update(TreeData&, int)
+  /**
+   * Workspaces are taken from the ones previously released or, if none, are
+   * copied from `D` (parameters, scaling, and probabilities included). All
+   * the workspaces share the annotations (see TreeInfo).
+   */
+  std::unique_ptr< TreeData > acquire();
+  
+  //! Returns the workspace so it can be reused by a later call to acquire()
+  void release(std::unique_ptr< TreeData > W);
+  
+  //! Hash of everything that determines the likelihood (see same_problem)
+  std::size_t problem_hash() const;
+  
+  //! Whether both trees have the same likelihood for any set of parameters,
+  //! i.e., same topology, pruning sequence, node types, and annotations
+  bool same_problem(const AphyloPruner & other) const;
+  
   AphyloPruner(
     const pruner::vv_uint & A,
     const pruner::v_uint  & Ntype,
     const pruner::uint    & nannotated,
     const pruner::v_uint  & source,
     const pruner::v_uint  & target,
-    pruner::uint & res
-  ) : Tree<TreeData>(source, target, res), D(A, Ntype, nannotated) {
+    pruner::uint & res,
+    double max_bytes = APHYLO_MAX_BYTES
+  ) : Tree<TreeData>(source, target, res), D(A, Ntype, nannotated, max_bytes) {
     
     // First things first, setting the Tree data and the likelihood function
     this->args = &D;
     this->fun  = likelihood;
     
-    // Figuring out the corrected pseq; ------------------------------------------
+    // Figuring out the reduced pseq; ------------------------------------------
     
-    // This flags which to include
-    std::vector< bool > has_ann(A.size(), false);
+    // Number of tips with annotations below each node (see set_ann)
+    const pruner::v_uint & pseq = *this->get_postorder_ptr();
+    const pruner::Adjacency & off = *this->get_offspring_ptr();
+    nann_below.resize(this->n_nodes(), 0u);
+    for (auto i = pseq.begin(); i != pseq.end(); ++i) {
+      
+      if (off[*i].size() == 0u)
+        nann_below[*i] = D.A.has_ann(*i) ? 1u : 0u;
+      else
+        for (auto o = off[*i].begin(); o != off[*i].end(); ++o)
+          nann_below[*i] += nann_below[*o];
+      
+    }
     
-    // This is a pointer to the set of offsprings. This is how we check which
-    // is leaf or not
-    const pruner::vv_uint * offspring = this->get_offspring_ptr();
+    // Computed now so that parallel updates don't modify the tree
+    const pruner::vv_uint & levels = this->get_levels();
+    node_level.resize(this->n_nodes(), 0u);
+    for (pruner::uint l = 0u; l < levels.size(); ++l)
+      for (auto i = levels[l].begin(); i != levels[l].end(); ++i)
+        node_level[*i] = l;
     
-    // This is the current POSTORDER sequence. We save it just in case
-    pruner::v_uint cur_pseq = this->get_postorder();
-    pruner::v_uint new_pseq;
-    new_pseq.reserve(cur_pseq.size());
+    set_pseq_reduced();
     
-    // We start iterating through the annotations
-    for (auto i = cur_pseq.begin(); i != cur_pseq.end(); ++i) {
+    pseq_pos.resize(this->n_nodes(), this->n_nodes());
+    for (pruner::uint i = 0u; i < pseq.size(); ++i)
+      pseq_pos[pseq[i]] = i;
+    
+    // Tips depend on psi and eta, and internal nodes on the transition
+    // matrix of their type and on whatever their offspring depend on.
+    node_deps.resize(this->n_nodes(), 0u);
+    for (auto i = pseq.begin(); i != pseq.end(); ++i) {
       
-      // First check if it is leaf or not
-      if ((offspring->at(*i).size()) == 0u) {
-        
-        // Checking annotations
-        unsigned int n9s = 0u;
-        for (unsigned int j = 0u; j < A[0u].size(); ++j) { 
-          if (A[*i][j] == 9u) {
-            ++n9s;
-            break;
-          }
-        }
-          
-        // At least has a single annotation!
-        if (n9s < A[0u].size()) {
-          has_ann[*i] = true;
-          new_pseq.push_back(*i);
-        }
-          
-      } else { // The case for interior nodes
-        
-        // We need to iterate through its offsprings
-        for (auto off = (offspring->at(*i)).begin(); off != (offspring->at(*i)).end(); ++off) 
-          // Any of its offspring has an annotation?
-          if (has_ann[*off]) {
-            has_ann[*i] = true;
-            new_pseq.push_back(*i);
-            break;
-          }
-          
+      if (off[*i].size() == 0u) {
+        node_deps[*i] = APHYLO_DEP_TIP;
+        continue;
+      }
+      
+      node_deps[*i] = (D.types[*i] == 0u) ? APHYLO_DEP_MU_D : APHYLO_DEP_MU_S;
+      for (auto o = off[*i].begin(); o != off[*i].end(); ++o)
+        node_deps[*i] |= node_deps[*o];
+      
+    }
+    
+    // Only the nodes in the pruning sequence are written to. As all the rows
+    // start at 1, these are valid for either sequence.
+    D.init_Pr(get_pseq(true));
+    D.pseq_id = use_reduced(D) ? pseq_version : 0u;
+    
+    return;
+    
+  };
+  
+  ~AphyloPruner() {
+    
+    this->args = nullptr;
+    
+  };
+  
+};
+
+/**@brief Computes the likelihood reusing the rows of `Pr` that are still valid.
+ * 
+ * If the scaling or the kernel changed since the last call (see
+ * `TreeData::all_dirty`), psi or eta changed (all the nodes in the pruning
+ * sequence depend on the tips), or the annotations were modified through
+ * another workspace, the whole tree is pruned. Otherwise, only the nodes that
+ * depend on the parameters that changed are updated (see `node_deps`), e.g.,
+ * changing `mu_d` skips subtrees without duplication nodes, and changing only
+ * `Pi` just recomputes the log-likelihood from the root. Likewise, only the
+ * nodes whose annotations changed and their ancestors are updated, which is
+ * O(depth) per changed annotation. Nodes not in the pruning sequence are
+ * skipped, as in a full pass.
+ * 
+ * The pruning sequence is either the full postorder or the reduced one (see
+ * use_reduced). Switching between them, or rebuilding the reduced sequence
+ * (see set_ann), resets `Pr` (see TreeData::reset_Pr) and prunes the whole
+ * tree.
+ * 
+ * The tree itself is not modified, so calls with different workspaces can run
+ * at the same time.
+ */
+inline void AphyloPruner::update(TreeData & W, int nthreads) {
+  
+  if (W.info_version != W.info->version) {
+    W.all_dirty    = true;
+    W.info_version = W.info->version;
+  }
+  
+  bool reduced = use_reduced(W);
+  const pruner::v_uint & pseq = get_pseq(reduced);
+  
+  pruner::uint pseq_id = reduced ? pseq_version : 0u;
+  if (W.pseq_id != pseq_id) {
+    W.reset_Pr(pseq);
+    W.pseq_id   = pseq_id;
+    W.all_dirty = true;
+  }
+  
+  if (W.changed & APHYLO_DEP_TIP)
+    W.all_dirty = true;
+  
+  // Before pruning, as threads share the workspace in parallel updates
+  W.update_transition();
+  
+  // Views of Pr returned to R keep the old values (see StateMatrix::detach)
+  if (W.all_dirty || W.changed || W.dirty.size())
+    W.Pr.detach();
+  
+  if (W.all_dirty) {
+    
+    if (reduced && (nthreads > 1))
+      this->prune_postorder_parallel(nthreads, &W, levels_reduced);
+    else if (reduced)
+      this->prune_postorder(&W, pseq_reduced);
+    else if (nthreads > 1)
+      this->prune_postorder_parallel(nthreads, &W);
+    else
+      this->prune_postorder(&W);
+    
+    W.nupdated  = pseq.size();
+    W.all_dirty = false;
+    W.changed   = 0u;
+    W.dirty.clear();
+    return;
+    
+  }
+  
+  W.nupdated = 0u;
+  if ((W.changed == 0u) && (W.dirty.size() == 0u))
+    return;
+  
+  // Nodes that depend on the modified parameters. Ancestors of a flagged node
+  // are flagged too, so the root is included if any node is.
+  pruner::v_uint seq;
+  if (W.changed & ~APHYLO_DEP_PI)
+    for (auto i = pseq.begin(); i != pseq.end(); ++i)
+      if (node_deps[*i] & W.changed) {
+        W.in_update[*i] = true;
+        seq.push_back(*i);
       }
+  
+  // Paths from the modified nodes to the root
+  for (auto i = W.dirty.begin(); i != W.dirty.end(); ++i) {
+    
+    pruner::uint node = *i;
+    while (
+        !W.in_update[node] && (pseq_pos[node] < pseq_pos.size()) &&
+        (!reduced || in_reduced[node])
+    ) {
+      
+      W.in_update[node] = true;
+      seq.push_back(node);
+      
+      if (this->parents[node].size() == 0u)
+        break;
+      
+      node = this->parents[node][0u];
       
     }
     
-    // Just enough space
-    new_pseq.shrink_to_fit();
+  }
+  
+  bool pi_changed = (W.changed & APHYLO_DEP_PI) != 0u;
+  W.changed = 0u;
+  W.dirty.clear();
+  if (seq.size() == 0u) {
+    
+    // Only the root's prior changed
+    if (pi_changed && pseq.size())
+      root_ll(&W, pseq.back());
+    
+    return;
+    
+  }
+  
+  // Same order as in the pruning sequence, so the root is last
+  std::sort(seq.begin(), seq.end(), [this](pruner::uint a, pruner::uint b) {
+    return pseq_pos[a] < pseq_pos[b];
+  });
+  
+  for (auto i = seq.begin(); i != seq.end(); ++i)
+    W.in_update[*i] = false;
+  
+  this->prune_postorder(&W, seq);
+  W.nupdated = seq.size();
+  
+  return;
+  
+}
+
+inline void AphyloPruner::set_pseq_reduced() {
+  
+  pseq_reduced.clear();
+  in_reduced.assign(this->n_nodes(), false);
+  const pruner::v_uint & pseq = *this->get_postorder_ptr();
+  for (auto i = pseq.begin(); i != pseq.end(); ++i)
+    if (nann_below[*i]) {
+      pseq_reduced.push_back(*i);
+      in_reduced[*i] = true;
+    }
+  
+  const pruner::vv_uint & levels = this->get_levels();
+  levels_reduced.assign(levels.size(), pruner::v_uint());
+  for (pruner::uint l = 0u; l < levels.size(); ++l)
+    for (auto i = levels[l].begin(); i != levels[l].end(); ++i)
+      if (nann_below[*i])
+        levels_reduced[l].push_back(*i);
+  
+  nstale = 0u;
+  ++pseq_version;
+  
+  return;
+  
+}
+
+inline void AphyloPruner::set_ann(
+    pruner::uint i,
+    pruner::uint j,
+    pruner::uint x
+) {
+  
+  bool had_ann = D.A.has_ann(i);
+  D.set_ann(i, j, x);
+  
+  // Only the annotations of the tips are used (see likelihood())
+  if ((this->offspring[i].size() != 0u) || (D.A.has_ann(i) == had_ann))
+    return;
+  
+  // Ancestors (and the tip) that enter the reduced sequence. The sequence is
+  // closed upwards, so these are the ones below the first ancestor in it.
+  pruner::v_uint added;
+  pruner::uint node = i;
+  while (true) {
     
-    // Resetting the pseq, only if it has nodes on it!
-    if (new_pseq.size() != 0u) {
-      res = this->set_postorder(new_pseq);
-      if (res != 0u)
-        throw std::logic_error("While resetting the POSTORDER.");
+    if (had_ann) {
+      
+      if ((--nann_below[node] == 0u) && in_reduced[node])
+        ++nstale;
+      
+    } else if (nann_below[node]++ == 0u) {
+      
+      if (in_reduced[node])
+        --nstale;
+      else
+        added.push_back(node);
+      
     }
     
-    // Freeing memory.
-    offspring = nullptr;
+    if (this->parents[node].size() == 0u)
+      break;
+    
+    node = this->parents[node][0u];
+    
+  }
+  
+  // Nodes left without annotated tips below stay in the sequence (see
+  // pseq_reduced) until these are most of it
+  if (had_ann) {
+    
+    if (2u * nstale > pseq_reduced.size())
+      set_pseq_reduced();
+    
+    return;
     
+  }
+  
+  if (added.size() == 0u)
     return;
+  
+  // With compact storage (see TreeData::init_Pr), nodes outside the sequence
+  // have no rows of their own, so Pr must be reallocated
+  if (D.Pr.share_rowmap()) {
+    set_pseq_reduced();
+    return;
+  }
+  
+  // Spliced in postorder. Their rows are still the neutral element, and
+  // these are on the path from the tip (see TreeData::set_ann), so update()
+  // computes them.
+  for (auto a = added.begin(); a != added.end(); ++a) {
+    
+    auto pos = std::lower_bound(
+      pseq_reduced.begin(), pseq_reduced.end(), *a,
+      [this](pruner::uint x, pruner::uint y) {return pseq_pos[x] < pseq_pos[y];}
+      );
+    
+    pseq_reduced.insert(pos, *a);
+    levels_reduced[node_level[*a]].push_back(*a);
+    in_reduced[*a] = true;
+    
+  }
+  
+  return;
+  
+}
+
+inline std::size_t AphyloPruner::problem_hash() const {
+  
+  std::size_t ans = D.A.hash();
+  
+  const pruner::v_uint & pseq = *this->get_postorder_ptr();
+  hash_combine(ans, pseq.size());
+  for (auto i = pseq.begin(); i != pseq.end(); ++i) {
+    
+    hash_combine(ans, *i);
+    hash_combine(ans, D.types[*i]);
+    
+    const pruner::Adjacency & offspring = *this->get_offspring_ptr();
+    for (auto o = offspring[*i].begin(); o != offspring[*i].end(); ++o)
+      hash_combine(ans, *o);
+    
+  }
+  
+  return ans;
+  
+}
+
+inline bool AphyloPruner::same_problem(const AphyloPruner & other) const {
+  
+  if (this == &other)
+    return true;
+  
+  return (*this->get_postorder_ptr() == *other.get_postorder_ptr()) &&
+    (*this->get_offspring_ptr() == *other.get_offspring_ptr()) &&
+    (D.types == other.D.types) && (D.A == other.D.A);
+  
+}
+
+inline std::unique_ptr< TreeData > AphyloPruner::acquire() {
+  
+  {
+    std::lock_guard< std::mutex > lock(workspaces_mutex);
+    if (workspaces.size()) {
+      
+      std::unique_ptr< TreeData > W = std::move(workspaces.back());
+      workspaces.pop_back();
+      return W;
+      
+    }
+  }
+  
+  return std::unique_ptr< TreeData >(new TreeData(D));
+  
+}
+
+inline void AphyloPruner::release(std::unique_ptr< TreeData > W) {
+  
+  std::lock_guard< std::mutex > lock(workspaces_mutex);
+  workspaces.push_back(std::move(W));
+  return;
+  
+}
+
+/**@brief Groups trees with the same likelihood (see AphyloPruner::same_problem),
+ * so each group is evaluated once per set of parameters.
+ * 
+ * `rep[i]` is the first tree identical to the i-th one (itself if none), so
+ * `rep[i] <= i`. Since annotations can be modified (see TreeData::set_ann),
+ * the groups are only valid while the annotations of all the trees are the
+ * same as when they were built (see valid()).
+ */
+class ProblemDedup {
+public:
+  
+  pruner::v_uint rep;
+  std::vector< unsigned long > versions;
+  
+  ProblemDedup() {};
+  ProblemDedup(const std::vector< AphyloPruner * > & trees) {build(trees);};
+  ~ProblemDedup() {};
+  
+  void build(const std::vector< AphyloPruner * > & trees);
+  
+  bool valid(const std::vector< AphyloPruner * > & trees) const {
+    
+    if (versions.size() != trees.size())
+      return false;
+    
+    for (pruner::uint i = 0u; i < trees.size(); ++i)
+      if (trees[i]->D.info->version != versions[i])
+        return false;
+    
+    return true;
     
   };
   
-  ~AphyloPruner() {
+  //! Rebuilds the groups if they are no longer valid
+  void update(const std::vector< AphyloPruner * > & trees) {
+    if (!valid(trees))
+      build(trees);
+    return;
+  };
+  
+};
+
+inline void ProblemDedup::build(const std::vector< AphyloPruner * > & trees) {
+  
+  rep.resize(trees.size());
+  versions.resize(trees.size());
+  
+  // Hash collisions are resolved by comparing the trees
+  std::unordered_multimap< std::size_t, pruner::uint > seen;
+  for (pruner::uint i = 0u; i < trees.size(); ++i) {
     
-    this->args = nullptr;
+    versions[i] = trees[i]->D.info->version;
+    rep[i]      = i;
+    
+    std::size_t h = trees[i]->problem_hash();
+    auto range    = seen.equal_range(h);
+    for (auto j = range.first; j != range.second; ++j)
+      if (trees[j->second]->same_problem(*trees[i])) {
+        rep[i] = j->second;
+        break;
+      }
     
+    if (rep[i] == i)
+      seen.emplace(h, i);
+    
+  }
+  
+  return;
+  
+}
+
+/**@brief Trees with repeated annotation columns, split by column.
+ * 
+ * The functions evolve independently given the tree and the parameters, so
+ * the log-likelihood of a tree is the sum of those of its columns, each as a
+ * tree with a single function. For trees where at least two columns are
+ * identical, a single-function tree is built for each distinct column (with
+ * the same topology and node types), so the log-likelihood takes one pruning
+ * per distinct column, weighted by its number of copies (`counts`). Other
+ * trees are pruned as they are.
+ * 
+ * The columns of the i-th tree are `columns[first[i]]`, ...,
+ * `columns[first[i + 1] - 1]` (none if not split). As with ProblemDedup, these
+ * are only valid while the annotations are the same as when built.
+ */
+class ColumnDedup {
+public:
+  
+  std::vector< std::shared_ptr< AphyloPruner > > columns;
+  pruner::v_dbl counts;
+  pruner::v_uint first;
+  std::vector< unsigned long > versions;
+  
+  ColumnDedup() {};
+  ColumnDedup(const std::vector< AphyloPruner * > & trees) {build(trees);};
+  ~ColumnDedup() {};
+  
+  void build(const std::vector< AphyloPruner * > & trees);
+  
+  bool valid(const std::vector< AphyloPruner * > & trees) const {
+    
+    if (versions.size() != trees.size())
+      return false;
+    
+    for (pruner::uint i = 0u; i < trees.size(); ++i)
+      if (trees[i]->D.info->version != versions[i])
+        return false;
+    
+    return true;
+    
+  };
+  
+  //! Rebuilds the columns if they are no longer valid
+  void update(const std::vector< AphyloPruner * > & trees) {
+    if (!valid(trees))
+      build(trees);
+    return;
+  };
+  
+  //! Whether the i-th tree is split
+  bool split(pruner::uint i) const {
+    return first[i + 1u] > first[i];
   };
   
 };
 
+inline void ColumnDedup::build(const std::vector< AphyloPruner * > & trees) {
+  
+  columns.clear();
+  counts.clear();
+  first.assign(1u, 0u);
+  versions.resize(trees.size());
+  
+  for (pruner::uint i = 0u; i < trees.size(); ++i) {
+    
+    const AphyloPruner & tree = *trees[i];
+    const AnnotationMatrix & A = tree.D.A;
+    versions[i] = tree.D.info->version;
+    
+    // Distinct columns, and the number of copies of each
+    pruner::v_uint rep;
+    pruner::v_dbl nrep;
+    for (pruner::uint p = 0u; p < A.ncols(); ++p) {
+      
+      pruner::uint k = 0u;
+      for (; k < rep.size(); ++k) {
+        
+        pruner::uint r = 0u;
+        while ((r < A.nrows()) && (A.code(r, rep[k]) == A.code(r, p)))
+          ++r;
+        
+        if (r == A.nrows())
+          break;
+        
+      }
+      
+      if (k == rep.size()) {
+        rep.push_back(p);
+        nrep.push_back(1.0);
+      } else
+        nrep[k] += 1.0;
+      
+    }
+    
+    if (rep.size() < A.ncols()) {
+      
+      pruner::v_uint source, target;
+      const pruner::Adjacency & offspring = *tree.get_offspring_ptr();
+      for (pruner::uint n = 0u; n < tree.n_nodes(); ++n)
+        for (auto o = offspring[n].begin(); o != offspring[n].end(); ++o) {
+          source.push_back(n);
+          target.push_back(*o);
+        }
+      
+      for (pruner::uint k = 0u; k < rep.size(); ++k) {
+        
+        pruner::vv_uint A_k(A.nrows(), pruner::v_uint(1u));
+        for (pruner::uint r = 0u; r < A.nrows(); ++r)
+          A_k[r][0u] = A(r, rep[k]);
+        
+        pruner::uint res;
+        columns.push_back(std::make_shared< AphyloPruner >(
+          A_k, tree.D.types, tree.D.nannotated, source, target, res,
+          tree.D.max_bytes
+        ));
+        
+        if (res != 0u)
+          throw std::logic_error("Splitting the columns of a tree failed.");
+        
+        counts.push_back(nrep[k]);
+        
+      }
+      
+    }
+    
+    first.push_back(columns.size());
+    
+  }
+  
+  return;
+  
+}
+
 #endif
 
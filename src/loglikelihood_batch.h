@@ -0,0 +1,360 @@
+#include <string>
+#include <cstdio>
+#include <stdexcept>
+#include "pruner.hpp"
+#include "TreeData.hpp" // TreeData definition
+#include "loglikelihood.h" // AphyloPruner definition
+
+#ifndef APHYLO_LOGLIKELIHOOD_BATCH_H
+#define APHYLO_LOGLIKELIHOOD_BATCH_H 1
+
+/**@brief Workspace to evaluate K sets of parameters in a single traversal.
+ *
+ * Probabilities are stored as node x state x K, so all the loops in the
+ * kernels run over K in the innermost level (contiguous memory). Likewise,
+ * each entry of the 2x2 matrices is a vector of length K. The arithmetic for
+ * each k is done in the same order as in likelihood(), so the k-th result
+ * matches what a call with the k-th set of parameters would return.
+ *
+ * As with TreeData::Pr, the probabilities are allocated within the memory
+ * budget of the tree when pruning (see init_Pr).
+ */
+class TreeDataBatch {
+
+public:
+
+  pruner::uint K, n, nstates, nfuns;
+
+  v_dbl_aligned Pr;        // n x nstates x K, allocated by init_Pr()
+  v_dbl_aligned Pr_lscale; // n x K
+
+  // Row of each node in Pr and Pr_lscale (see init_Pr)
+  pruner::v_uint rowmap;
+
+  // Parameters: 2 x 2 x K (MU and PSI), 2 x 3 x K (tip factors, see
+  // set_params) and nstates x K (Pi)
+  v_dbl_aligned MU_d, MU_s, tipf, Pi;
+
+  // Scratch space (nstates x K)
+  v_dbl_aligned buff;
+
+  pruner::v_dbl ll;
+
+  // Whether any of the K sets of parameters includes eta
+  bool use_eta = false;
+
+  double * pr(pruner::uint i, pruner::uint s) {
+    return &Pr[((std::size_t) rowmap[i] * nstates + s) * K];
+  };
+
+  double * lscale(pruner::uint i) {
+    return &Pr_lscale[(std::size_t) rowmap[i] * K];
+  };
+
+  TreeDataBatch(
+    pruner::uint n_, pruner::uint nfuns_, pruner::uint K_
+  ) : K(K_), n(n_), nstates(1u << nfuns_), nfuns(nfuns_),
+  MU_d(4u * K_), MU_s(4u * K_), tipf(6u * K_), Pi((1u << nfuns_) * K_),
+  buff((std::size_t) (1u << nfuns_) * K_), ll(K_) {};
+
+  ~TreeDataBatch() {};
+
+  void set_params(const double * par, pruner::uint k, double prop_type_d);
+  void prune(
+    AphyloPruner & tree, bool factorized, pruner::uint scaling,
+    bool reduced = true
+  );
+
+private:
+
+  void init_Pr(const pruner::v_uint & pseq, double max_bytes);
+  void rescale(pruner::uint i);
+
+};
+
+/**@brief Sets the k-th set of parameters.
+ *
+ * @param par Array of length `APHYLO_NPARS` (see the `APHYLO_PAR_*` macros).
+ * As in LogLike_pruner, a negative `Pi` means using the stationary value, and
+ * negative `eta`s that the annotation bias is not included.
+ */
+inline void TreeDataBatch::set_params(
+    const double * par,
+    pruner::uint k,
+    double prop_type_d
+) {
+
+  mat22 mu_d = transition_mat({par[APHYLO_PAR_MU_D0], par[APHYLO_PAR_MU_D1]});
+  mat22 mu_s = transition_mat({par[APHYLO_PAR_MU_S0], par[APHYLO_PAR_MU_S1]});
+  mat22 psi  = transition_mat({par[APHYLO_PAR_PSI0], par[APHYLO_PAR_PSI1]});
+
+  for (pruner::uint i = 0u; i < 2u; ++i)
+    for (pruner::uint j = 0u; j < 2u; ++j) {
+      MU_d[(i * 2u + j) * K + k] = mu_d[i][j];
+      MU_s[(i * 2u + j) * K + k] = mu_s[i][j];
+    }
+
+  // Tip factors for each state (0/1) and annotation (0, 1, 9). These are the
+  // same terms used in likelihood(). Skipped terms are set to 1.
+  double eta0 = par[APHYLO_PAR_ETA0], eta1 = par[APHYLO_PAR_ETA1];
+  if (eta0 >= 0.0)
+    use_eta = true;
+
+  for (pruner::uint b = 0u; b < 2u; ++b) {
+
+    if (eta0 >= 0.0) {
+      tipf[(b * 3u + 0u) * K + k] = psi[b][0u] * eta0;
+      tipf[(b * 3u + 1u) * K + k] = psi[b][1u] * eta1;
+      tipf[(b * 3u + 2u) * K + k] =
+        (1.0 - eta0) * psi[b][0u] + (1.0 - eta1) * psi[b][1u];
+    } else {
+      tipf[(b * 3u + 0u) * K + k] = psi[b][0u];
+      tipf[(b * 3u + 1u) * K + k] = psi[b][1u];
+      tipf[(b * 3u + 2u) * K + k] = 1.0;
+    }
+
+  }
+
+  // Root node probabilities
+  double pi = par[APHYLO_PAR_PI];
+  if (pi < 0.0)
+    pi = (1 - prop_type_d) * par[APHYLO_PAR_MU_S0] /
+      (par[APHYLO_PAR_MU_S0] + par[APHYLO_PAR_MU_S1]) +
+      prop_type_d * par[APHYLO_PAR_MU_D0] /
+        (par[APHYLO_PAR_MU_D0] + par[APHYLO_PAR_MU_D1]);
+
+  pruner::v_dbl Pi_k(nstates);
+  root_node_pr(Pi_k, pi, StateBits(nfuns));
+  for (pruner::uint s = 0u; s < nstates; ++s)
+    Pi[s * K + k] = Pi_k[s];
+
+  return;
+
+}
+
+/**@brief Allocates `Pr` and `Pr_lscale` within the memory budget.
+ *
+ * Same as TreeData::init_Pr: a row per node if these fit in `max_bytes`, and
+ * otherwise only the rows of the nodes in `pseq`, with the rest sharing a
+ * single row of ones. Throws `std::length_error` if not even that fits.
+ */
+inline void TreeDataBatch::init_Pr(
+    const pruner::v_uint & pseq,
+    double max_bytes
+) {
+
+  double nrows = (double) n;
+  if (TreeData::Pr_bytes(nrows, nfuns) * K > max_bytes) {
+
+    nrows = pseq.size() + 1.0;
+    if (TreeData::Pr_bytes(nrows, nfuns) * K > max_bytes) {
+
+      char msg[512];
+      snprintf(
+        msg, sizeof(msg),
+        "Storing the probabilities of %.0f nodes with %u functions for %u sets "
+        "of parameters (nodes x 2^P x K doubles) requires %.3g GB, which "
+        "exceeds the memory budget of %.3g GB (see options(aphylo_max_memory)).",
+        nrows, nfuns, K, TreeData::Pr_bytes(nrows, nfuns) * K / 1073741824.0,
+        max_bytes / 1073741824.0
+      );
+
+      throw std::length_error(msg);
+
+    }
+
+    // All the nodes not in -pseq- share the last row
+    rowmap.assign(n, (pruner::uint) pseq.size());
+    for (pruner::uint k = 0u; k < pseq.size(); ++k)
+      rowmap[pseq[k]] = k;
+
+  } else {
+
+    rowmap.resize(n);
+    for (pruner::uint i = 0u; i < n; ++i)
+      rowmap[i] = i;
+
+  }
+
+  Pr.assign((std::size_t) nrows * nstates * K, 1.0);
+  Pr_lscale.assign((std::size_t) nrows * K, 0.0);
+
+  return;
+
+}
+
+// Same as rescale_row(), but for each one of the K columns of the node
+inline void TreeDataBatch::rescale(pruner::uint i) {
+
+  double * ls = lscale(i);
+  for (pruner::uint k = 0u; k < K; ++k) {
+
+    double m = pr(i, 0u)[k];
+    for (pruner::uint s = 1u; s < nstates; ++s)
+      if (pr(i, s)[k] > m)
+        m = pr(i, s)[k];
+
+    if ((m >= APHYLO_SCALING_THRESHOLD) || !(m > 0.0))
+      continue;
+
+    int e;
+    std::frexp(m, &e);
+    double factor = std::ldexp(1.0, -e);
+    for (pruner::uint s = 0u; s < nstates; ++s)
+      pr(i, s)[k] *= factor;
+
+    ls[k] -= (double) e * APHYLO_LN2;
+
+  }
+
+  return;
+
+}
+
+/**@brief Computes the K log-likelihoods in a single postorder traversal.
+ *
+ * Only the `APHYLO_SCALING_NONE` and `APHYLO_SCALING_RESCALE` modes are
+ * supported. As in AphyloPruner::update, the reduced pruning sequence is used
+ * if `reduced` and none of the sets of parameters includes eta.
+ */
+inline void TreeDataBatch::prune(
+    AphyloPruner & tree,
+    bool factorized,
+    pruner::uint scaling,
+    bool reduced
+) {
+
+  if (scaling == APHYLO_SCALING_LOG)
+    throw std::invalid_argument("The log scaling is not supported in batches.");
+
+  const TreeData & D = tree.D;
+  const pruner::v_uint  & pseq      = tree.get_pseq(reduced && !use_eta);
+  const pruner::Adjacency & offspring = *tree.get_offspring_ptr();
+
+  init_Pr(pseq, D.max_bytes);
+
+  double * acc = &buff[0u];
+  double * w   = &buff[K];
+  pruner::uint k, s, s_n, p;
+
+  for (auto n = pseq.begin(); n != pseq.end(); ++n) {
+
+    double * ls = lscale(*n);
+    std::fill(ls, ls + K, 0.0);
+
+    if (offspring[*n].size() == 0u) {
+
+      for (s = 0u; s < nstates; ++s) {
+
+        double * row = pr(*n, s);
+        std::fill(row, row + K, 1.0);
+
+        for (p = 0u; p < nfuns; ++p) {
+
+          // Annotation 9 is the third factor
+          pruner::uint a = D.A[*n][p];
+          const double * f = &tipf[(D.states[s][p] * 3u + (a == 9u ? 2u : a)) * K];
+          for (k = 0u; k < K; ++k)
+            row[k] *= f[k];
+
+        }
+
+      }
+
+      if (scaling == APHYLO_SCALING_RESCALE)
+        rescale(*n);
+
+      continue;
+
+    }
+
+    const v_dbl_aligned & M = (D.types[*n] == 0u) ? MU_d : MU_s;
+
+    std::fill(pr(*n, 0u), pr(*n, 0u) + (std::size_t) nstates * K, 1.0);
+    for (auto o = offspring[*n].begin(); o != offspring[*n].end(); ++o) {
+
+      if (factorized) {
+
+        // Same as kron_transition, but vectorized over k
+        std::copy(pr(*o, 0u), pr(*o, 0u) + (std::size_t) nstates * K, buff.begin());
+        for (p = 0u; p < nfuns; ++p) {
+
+          pruner::uint stride = 1u << p;
+          for (pruner::uint b = 0u; b < nstates; b += (stride << 1u))
+            for (pruner::uint i = b; i < (b + stride); ++i) {
+
+              double * x0 = &buff[(std::size_t) i * K];
+              double * x1 = &buff[(std::size_t) (i + stride) * K];
+              for (k = 0u; k < K; ++k) {
+                double y0 = x0[k], y1 = x1[k];
+                x0[k] = M[0u * K + k] * y0 + M[1u * K + k] * y1;
+                x1[k] = M[2u * K + k] * y0 + M[3u * K + k] * y1;
+              }
+
+            }
+
+        }
+
+        for (s = 0u; s < nstates; ++s) {
+          double * row = pr(*n, s);
+          const double * x = &buff[(std::size_t) s * K];
+          for (k = 0u; k < K; ++k)
+            row[k] *= x[k];
+        }
+
+      } else {
+
+        for (s = 0u; s < nstates; ++s) {
+
+          std::fill(acc, acc + K, 0.0);
+          for (s_n = 0u; s_n < nstates; ++s_n) {
+
+            std::fill(w, w + K, 1.0);
+            for (p = 0u; p < nfuns; ++p) {
+              const double * m = &M[(D.states[s][p] * 2u + D.states[s_n][p]) * K];
+              for (k = 0u; k < K; ++k)
+                w[k] *= m[k];
+            }
+
+            const double * x = pr(*o, s_n);
+            for (k = 0u; k < K; ++k)
+              acc[k] += w[k] * x[k];
+
+          }
+
+          double * row = pr(*n, s);
+          for (k = 0u; k < K; ++k)
+            row[k] *= acc[k];
+
+        }
+
+      }
+
+      const double * ls_o = lscale(*o);
+      for (k = 0u; k < K; ++k)
+        ls[k] += ls_o[k];
+
+      if (scaling == APHYLO_SCALING_RESCALE)
+        rescale(*n);
+
+    }
+
+  }
+
+  // Joint likelihood at the root
+  pruner::uint root = pseq.back();
+  for (k = 0u; k < K; ++k) {
+
+    ll[k] = 0.0;
+    for (s = 0u; s < nstates; ++s)
+      ll[k] += Pi[s * K + k] * pr(root, s)[k];
+
+    ll[k] = log(ll[k]) - lscale(root)[k];
+
+  }
+
+  return;
+
+}
+
+#endif
@@ -0,0 +1,288 @@
+#include "pruner.hpp"
+#include "TreeData.hpp" // TreeData definition
+#include "loglikelihood.h" // AphyloPruner definition
+
+#ifndef APHYLO_LOGLIKELIHOOD_GRADIENT_H
+#define APHYLO_LOGLIKELIHOOD_GRADIENT_H 1
+
+/**@brief Same as kron_transition, but leaves the `skip`-th function as is.
+ * 
+ * Used to get the derivative of the transition w.r.t. the 2x2 matrix of a
+ * single function.
+ */
+inline void kron_transition_skip(
+    const mat22 & M,
+    double * x,
+    pruner::uint nfuns,
+    pruner::uint nstates,
+    pruner::uint skip
+) {
+  
+  double x0, x1;
+  for (pruner::uint p = 0u; p < nfuns; ++p) {
+    
+    if (p == skip)
+      continue;
+    
+    pruner::uint stride = 1u << p;
+    for (pruner::uint b = 0u; b < nstates; b += (stride << 1u))
+      for (pruner::uint k = b; k < (b + stride); ++k) {
+        
+        x0 = x[k];
+        x1 = x[k + stride];
+        
+        x[k]          = M[0u][0u] * x0 + M[0u][1u] * x1;
+        x[k + stride] = M[1u][0u] * x0 + M[1u][1u] * x1;
+        
+      }
+    
+  }
+  
+  return;
+  
+}
+
+/**@brief Gradient of the log-likelihood w.r.t. the model parameters.
+ * 
+ * Needs the probabilities from a previous call to `prune_postorder()` with the
+ * same parameters. The tree is then visited in PREORDER (reversed pruning
+ * sequence) computing the derivative of the log-likelihood w.r.t. each row of
+ * `Pr`, which is then used to compute the derivative w.r.t. the transition
+ * (interior nodes) and emission (tips) probabilities. Since the log-likelihood
+ * is linear in each row of `Pr`, the derivatives can be normalized at each
+ * node, so these don't underflow with the scaling modes.
+ * 
+ * @param grad Vector of length `APHYLO_NPARS` (see the `APHYLO_PAR_*` macros).
+ * @param stationary_pi When `true`, `Pi` was computed from `mu_d` and `mu_s`,
+ * so its derivative is added to those of the `mu`s.
+ */
+inline void gradient(
+    AphyloPruner & tree,
+    pruner::v_dbl & grad,
+    bool stationary_pi
+) {
+  
+  TreeData & D = tree.D;
+  const pruner::v_uint  & pseq      = tree.get_pseq(D);
+  const pruner::Adjacency & offspring = *tree.get_offspring_ptr();
+  
+  pruner::uint nstates = D.nstates, nfuns = D.nfuns;
+  pruner::uint s, p, q;
+  
+  grad.assign(APHYLO_NPARS, 0.0);
+  mat22 dPSI = {}, dMU_d = {}, dMU_s = {};
+  double deta[2u] = {0.0, 0.0}, dpi = 0.0;
+  
+  pruner::uint root = pseq.back();
+  if (offspring[root].size() == 0u)
+    return;
+  
+  // Derivative of the log-likelihood w.r.t. each row of Pr, within the memory
+  // budget. Only the rows of the nodes in the pruning sequence are read, so
+  // the compact layout works here too (see TreeData::init_Pr).
+  StateMatrix U = D.new_Pr(pseq, 0.0);
+  
+  // Root node
+  pruner::v_dbl x(nstates), y(nstates), V(nstates);
+  pr_row(D, root, &x[0u]);
+  
+  double z = 0.0;
+  for (s = 0u; s < nstates; ++s)
+    z += D.Pi[s] * x[s];
+  
+  for (s = 0u; s < nstates; ++s) {
+    
+    U[root][s] = D.Pi[s] / z;
+    
+    // Pi[s] = prod_p pi^(s_p) * (1 - pi)^(1 - s_p)
+    for (p = 0u; p < nfuns; ++p) {
+      
+      double dPi = D.states[s][p] ? 1.0 : -1.0;
+      for (q = 0u; q < nfuns; ++q)
+        if (q != p)
+          dPi *= D.states[s][q] ? D.pi : (1.0 - D.pi);
+      
+      dpi += x[s] / z * dPi;
+      
+    }
+    
+  }
+  
+  // Rows of the offspring of the current node and their transitions
+  std::vector< pruner::v_dbl > Pr_o, F_o;
+  
+  for (auto n = pseq.rbegin(); n != pseq.rend(); ++n) {
+    
+    const pruner::Adjacency::Row off = offspring[*n];
+    
+    if (off.size() == 0u) {
+      
+      // Tip emission probabilities, recomputed as in likelihood() without
+      // scaling. Then, the gradient is divided by sum_s U[s] * G[s].
+      pruner::v_dbl f(nfuns);
+      
+      z = 0.0;
+      for (s = 0u; s < nstates; ++s) {
+        
+        x[s] = 1.0;
+        for (p = 0u; p < nfuns; ++p) {
+          
+          pruner::uint a = D.A[*n][p], b = D.states[s][p];
+          if (D.eta[0u] >= 0.0)
+            f[p] = (a == 9u) ?
+              (1.0 - D.eta[0u]) * D.PSI[b][0u] + (1.0 - D.eta[1u]) * D.PSI[b][1u] :
+              D.PSI[b][a] * D.eta[a];
+          else
+            f[p] = (a == 9u) ? 1.0 : D.PSI[b][a];
+          
+          x[s] *= f[p];
+          
+        }
+        
+        z += U[*n][s] * x[s];
+        
+      }
+      
+      for (s = 0u; s < nstates; ++s)
+        for (p = 0u; p < nfuns; ++p) {
+          
+          pruner::uint a = D.A[*n][p], b = D.states[s][p];
+          
+          double coef = U[*n][s] / z;
+          for (q = 0u; q < nfuns; ++q)
+            if (q != p) {
+              
+              pruner::uint a_q = D.A[*n][q], b_q = D.states[s][q];
+              if (D.eta[0u] >= 0.0)
+                coef *= (a_q == 9u) ?
+                  (1.0 - D.eta[0u]) * D.PSI[b_q][0u] +
+                  (1.0 - D.eta[1u]) * D.PSI[b_q][1u] :
+                  D.PSI[b_q][a_q] * D.eta[a_q];
+              else if (a_q != 9u)
+                coef *= D.PSI[b_q][a_q];
+              
+            }
+          
+          if (D.eta[0u] >= 0.0) {
+            
+            if (a == 9u) {
+              dPSI[b][0u] += coef * (1.0 - D.eta[0u]);
+              dPSI[b][1u] += coef * (1.0 - D.eta[1u]);
+              deta[0u]    -= coef * D.PSI[b][0u];
+              deta[1u]    -= coef * D.PSI[b][1u];
+            } else {
+              dPSI[b][a] += coef * D.eta[a];
+              deta[a]    += coef * D.PSI[b][a];
+            }
+            
+          } else if (a != 9u)
+            dPSI[b][a] += coef;
+          
+        }
+      
+      continue;
+      
+    }
+    
+    // Interior nodes: Pr[n][s] = c * prod_o F_o[s], with F_o = M Pr[o]
+    const mat22 & M = (D.types[*n] == 0u) ? D.MU_d : D.MU_s;
+    mat22 & dM      = (D.types[*n] == 0u) ? dMU_d : dMU_s;
+    
+    mat22 Mt;
+    for (pruner::uint i = 0u; i < 2u; ++i)
+      for (pruner::uint j = 0u; j < 2u; ++j)
+        Mt[i][j] = M[j][i];
+    
+    Pr_o.resize(off.size(), pruner::v_dbl(nstates));
+    F_o.resize(off.size(), pruner::v_dbl(nstates));
+    for (pruner::uint o = 0u; o < off.size(); ++o) {
+      pr_row(D, off[o], &Pr_o[o][0u]);
+      F_o[o] = Pr_o[o];
+      kron_transition(M, &F_o[o][0u], nfuns, nstates);
+    }
+    
+    for (pruner::uint o = 0u; o < off.size(); ++o) {
+      
+      // Derivative w.r.t. F_o (up to a constant)
+      for (s = 0u; s < nstates; ++s) {
+        
+        V[s] = U[*n][s];
+        for (pruner::uint o2 = 0u; o2 < off.size(); ++o2) {
+          
+          if (o2 == o)
+            continue;
+          
+          double m = *std::max_element(F_o[o2].begin(), F_o[o2].end());
+          V[s] *= (m > 0.0) ? F_o[o2][s] / m : 0.0;
+          
+        }
+        
+      }
+      
+      z = 0.0;
+      for (s = 0u; s < nstates; ++s)
+        z += V[s] * F_o[o][s];
+      
+      for (s = 0u; s < nstates; ++s)
+        V[s] /= z;
+      
+      // Derivative w.r.t. the row of the offspring
+      std::copy(V.begin(), V.end(), U[off[o]]);
+      kron_transition(Mt, U[off[o]], nfuns, nstates);
+      
+      // Derivative w.r.t. the 2x2 matrix of each function
+      for (p = 0u; p < nfuns; ++p) {
+        
+        y = Pr_o[o];
+        kron_transition_skip(M, &y[0u], nfuns, nstates, p);
+        
+        pruner::uint stride = 1u << p;
+        for (pruner::uint b = 0u; b < nstates; b += (stride << 1u))
+          for (pruner::uint k = b; k < (b + stride); ++k) {
+            dM[0u][0u] += V[k] * y[k];
+            dM[0u][1u] += V[k] * y[k + stride];
+            dM[1u][0u] += V[k + stride] * y[k];
+            dM[1u][1u] += V[k + stride] * y[k + stride];
+          }
+        
+      }
+      
+    }
+    
+  }
+  
+  // Back to the parameters (see transition_mat)
+  grad[APHYLO_PAR_PSI0]  = dPSI[0u][1u] - dPSI[0u][0u];
+  grad[APHYLO_PAR_PSI1]  = dPSI[1u][0u] - dPSI[1u][1u];
+  grad[APHYLO_PAR_MU_D0] = dMU_d[0u][1u] - dMU_d[0u][0u];
+  grad[APHYLO_PAR_MU_D1] = dMU_d[1u][0u] - dMU_d[1u][1u];
+  grad[APHYLO_PAR_MU_S0] = dMU_s[0u][1u] - dMU_s[0u][0u];
+  grad[APHYLO_PAR_MU_S1] = dMU_s[1u][0u] - dMU_s[1u][1u];
+  
+  // Negative etas mean that these are not part of the model
+  if (D.eta[0u] >= 0.0) {
+    grad[APHYLO_PAR_ETA0] = deta[0u];
+    grad[APHYLO_PAR_ETA1] = deta[1u];
+  }
+  
+  if (stationary_pi) {
+    
+    // pi = (1 - prop_d) * mu_s0 / (mu_s0 + mu_s1) + prop_d * mu_d0 / (mu_d0 + mu_d1)
+    double mu_d0 = D.MU_d[0u][1u], mu_d1 = D.MU_d[1u][0u];
+    double mu_s0 = D.MU_s[0u][1u], mu_s1 = D.MU_s[1u][0u];
+    double S_d = (mu_d0 + mu_d1) * (mu_d0 + mu_d1);
+    double S_s = (mu_s0 + mu_s1) * (mu_s0 + mu_s1);
+    
+    grad[APHYLO_PAR_MU_D0] += dpi * D.prop_type_d * mu_d1 / S_d;
+    grad[APHYLO_PAR_MU_D1] -= dpi * D.prop_type_d * mu_d0 / S_d;
+    grad[APHYLO_PAR_MU_S0] += dpi * (1.0 - D.prop_type_d) * mu_s1 / S_s;
+    grad[APHYLO_PAR_MU_S1] -= dpi * (1.0 - D.prop_type_d) * mu_s0 / S_s;
+    
+  } else
+    grad[APHYLO_PAR_PI] = dpi;
+  
+  return;
+  
+}
+
+#endif
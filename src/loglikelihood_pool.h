@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include "pruner.hpp"
+#include "TreeData.hpp" // TreeData definition
+#include "loglikelihood.h" // AphyloPruner definition
+
+#ifndef APHYLO_LOGLIKELIHOOD_POOL_H
+#define APHYLO_LOGLIKELIHOOD_POOL_H 1
+
+/**@brief A set of trees whose log-likelihoods are computed together.
+ *
+ * The pool does not own the trees (they are owned by R, see
+ * `new_aphylo_pruner_pool()`). The parameters are set on all the trees, and
+ * the trees are then distributed across threads, each tree being pruned by a
+ * single thread. Trees are handed out dynamically from the largest to the
+ * smallest, so large trees don't end up last on a busy thread. Trees identical
+ * to an earlier one (see ProblemDedup) are not pruned, but take its
+ * log-likelihood, and trees with repeated columns are pruned by column (see
+ * ColumnDedup).
+ */
+class AphyloPrunerPool {
+
+public:
+
+  std::vector< AphyloPruner * > trees;
+
+  //! Order in which the trees are processed (largest pruning sequence first)
+  pruner::v_uint order;
+
+  //! Log-likelihood of each tree from the last call to update()
+  pruner::v_dbl ll;
+
+  //! Groups of identical trees
+  ProblemDedup dedup;
+
+  //! Trees split by column, which get the same settings and parameters as the
+  //! trees before each update
+  ColumnDedup columns;
+
+  AphyloPrunerPool(const std::vector< AphyloPruner * > & trees_);
+  ~AphyloPrunerPool() {};
+
+  void set_params(
+    const pruner::v_dbl & mu_d,
+    const pruner::v_dbl & mu_s,
+    const pruner::v_dbl & psi,
+    const pruner::v_dbl & eta,
+    double Pi
+  );
+  void set_factorized(bool factorized);
+  void set_scaling(pruner::uint scaling);
+  void set_reduced(bool reduced);
+
+  //! Updates all the trees and returns the sum of their log-likelihoods
+  double update(int nthreads = 1);
+
+private:
+
+  // Last values passed to the setters, applied to the columns in update()
+  pruner::v_dbl mu_d, mu_s, psi, eta;
+  double Pi = -1.0;
+  bool factorized = false, reduced = true;
+  pruner::uint scaling = APHYLO_SCALING_RESCALE;
+
+};
+
+inline AphyloPrunerPool::AphyloPrunerPool(
+    const std::vector< AphyloPruner * > & trees_
+) : trees(trees_), order(trees_.size()), ll(trees_.size(), 0.0) {
+
+  for (pruner::uint i = 0u; i < order.size(); ++i)
+    order[i] = i;
+
+  std::stable_sort(order.begin(), order.end(),
+    [this](pruner::uint a, pruner::uint b) {
+      return trees[a]->get_pseq(true).size() * trees[a]->D.nstates >
+        trees[b]->get_pseq(true).size() * trees[b]->D.nstates;
+    });
+
+  return;
+
+}
+
+inline void AphyloPrunerPool::set_params(
+    const pruner::v_dbl & mu_d_,
+    const pruner::v_dbl & mu_s_,
+    const pruner::v_dbl & psi_,
+    const pruner::v_dbl & eta_,
+    double Pi_
+) {
+
+  mu_d = mu_d_;
+  mu_s = mu_s_;
+  psi  = psi_;
+  eta  = eta_;
+  Pi   = Pi_;
+  for (auto t = trees.begin(); t != trees.end(); ++t)
+    (*t)->D.set_params(mu_d, mu_s, psi, eta, Pi);
+
+  return;
+
+}
+
+inline void AphyloPrunerPool::set_factorized(bool factorized_) {
+
+  factorized = factorized_;
+  for (auto t = trees.begin(); t != trees.end(); ++t)
+    (*t)->D.set_factorized(factorized);
+
+  return;
+
+}
+
+inline void AphyloPrunerPool::set_scaling(pruner::uint scaling_) {
+
+  scaling = scaling_;
+  for (auto t = trees.begin(); t != trees.end(); ++t)
+    (*t)->D.set_scaling(scaling);
+
+  return;
+
+}
+
+inline void AphyloPrunerPool::set_reduced(bool reduced_) {
+
+  reduced = reduced_;
+  for (auto t = trees.begin(); t != trees.end(); ++t)
+    (*t)->D.set_reduced(reduced);
+
+  return;
+
+}
+
+inline double AphyloPrunerPool::update(int nthreads) {
+
+  int ntrees = (int) order.size();
+  dedup.update(trees);
+  columns.update(trees);
+
+  for (auto t = columns.columns.begin(); t != columns.columns.end(); ++t) {
+    (*t)->D.set_factorized(factorized);
+    (*t)->D.set_scaling(scaling);
+    (*t)->D.set_reduced(reduced);
+    (*t)->D.set_params(mu_d, mu_s, psi, eta, Pi);
+  }
+
+  // Each tree is pruned serially, so the scratch space of the kernels (see
+  // likelihood()) is not shared across threads. Errors (e.g., if switching
+  // the pruning sequence exceeds the memory budget) are raised afterwards.
+  std::vector< std::string > errors(ntrees);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads) if (nthreads > 1)
+#endif
+  for (int k = 0; k < ntrees; ++k) {
+
+    if (dedup.rep[order[k]] != order[k])
+      continue;
+
+    try {
+
+      pruner::uint i = order[k];
+      if (columns.split(i)) {
+
+        ll[i] = 0.0;
+        for (pruner::uint c = columns.first[i]; c < columns.first[i + 1u]; ++c) {
+          columns.columns[c]->update(1);
+          ll[i] += columns.counts[c] * columns.columns[c]->D.ll;
+        }
+
+      } else {
+
+        trees[i]->update(1);
+        ll[i] = trees[i]->D.ll;
+
+      }
+
+    } catch (std::exception & e) {
+      errors[k] = e.what();
+    }
+
+  }
+
+  for (int k = 0; k < ntrees; ++k)
+    if (errors[k].size())
+      throw std::runtime_error(errors[k]);
+
+  // Added in the same order regardless of the number of threads
+  double ans = 0.0;
+  for (pruner::uint i = 0u; i < ll.size(); ++i) {
+    ll[i] = ll[dedup.rep[i]];
+    ans  += ll[i];
+  }
+
+  return ans;
+
+}
+
+#endif
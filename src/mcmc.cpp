@@ -0,0 +1,271 @@
+#include <Rcpp.h>
+#include <random>
+#include <cstdint>
+#include "pruner.hpp"
+#include "TreeData.hpp" // TreeData definition
+#include "loglikelihood.h" // AphyloPruner definition
+#include "aphylo_model.h" // AphyloModel definition
+using namespace Rcpp;
+
+// Settings of the sampler (see aphylo_mcmc_native)
+struct McmcControl {
+  pruner::uint nsteps, burnin, thin, warmup;
+  bool adaptive;
+  double scale, eps, lb, ub;
+};
+
+// Reflects `x` into [lb, ub], going back and forth if needed.
+inline double reflect(double x, double lb, double ub) {
+
+  if ((x >= lb) && (x <= ub))
+    return x;
+
+  double w = ub - lb;
+  double y = std::fmod(x - lb, 2.0 * w);
+  if (y < 0.0)
+    y += 2.0 * w;
+
+  return (y <= w) ? (lb + y) : (ub - (y - w));
+
+}
+
+// Lower triangular cholesky factor of the d x d matrix `S` (row-major) into
+// `L`. Returns false if `S` is not positive definite, in which case `L` is not
+// modified.
+inline bool cholesky(const pruner::v_dbl & S, pruner::uint d, pruner::v_dbl & L) {
+
+  pruner::v_dbl ans(d * d, 0.0);
+  for (pruner::uint j = 0u; j < d; ++j) {
+
+    double s = S[j * d + j];
+    for (pruner::uint k = 0u; k < j; ++k)
+      s -= ans[j * d + k] * ans[j * d + k];
+
+    if (!(s > 0.0))
+      return false;
+
+    ans[j * d + j] = std::sqrt(s);
+    for (pruner::uint i = j + 1u; i < d; ++i) {
+
+      double t = S[i * d + j];
+      for (pruner::uint k = 0u; k < j; ++k)
+        t -= ans[i * d + k] * ans[j * d + k];
+
+      ans[i * d + j] = t / ans[j * d + j];
+
+    }
+
+  }
+
+  L.swap(ans);
+  return true;
+
+}
+
+/**@brief Runs a single chain of the random-walk Metropolis sampler.
+ *
+ * Proposals are `x + L z`, with `z` standard normal and reflected into
+ * [lb, ub], so they are symmetric. Before `warmup` steps (or if not adaptive)
+ * `L = scale * I`. Afterwards, the adaptive Metropolis of Haario et al. (2001)
+ * uses the covariance of the chain so far, `L L' = 2.4^2/d (Cov + eps I)`.
+ *
+ * The samples kept (after `burnin`, every `thin` steps) are written to `out`
+ * (row-major, one row per sample) and their step numbers to `steps`.
+ *
+ * @return The acceptance rate.
+ */
+inline double mcmc_chain(
+    const AphyloModel & model,
+    std::vector< TreeData * > & W,
+    const double * initial,
+    const McmcControl & ctrl,
+    std::uint64_t seed,
+    double * out,
+    int * steps
+) {
+
+  pruner::uint d = model.npars;
+  std::mt19937_64 engine(seed);
+  std::normal_distribution< double > rnorm(0.0, 1.0);
+  std::uniform_real_distribution< double > runif(0.0, 1.0);
+
+  pruner::v_dbl x(initial, initial + d), y(d), z(d);
+  double fx = model(&x[0u], W);
+
+  // Running mean and covariance (Welford)
+  pruner::v_dbl mean(d, 0.0), M2(d * d, 0.0), S(d * d), delta(d);
+  pruner::v_dbl L(d * d, 0.0);
+  for (pruner::uint i = 0u; i < d; ++i)
+    L[i * d + i] = ctrl.scale;
+
+  double sd = 2.4 * 2.4 / d;
+  pruner::uint naccepted = 0u, nkept = 0u;
+  for (pruner::uint step = 1u; step <= ctrl.nsteps; ++step) {
+
+    // Proposal
+    for (pruner::uint i = 0u; i < d; ++i)
+      z[i] = rnorm(engine);
+
+    for (pruner::uint i = 0u; i < d; ++i) {
+
+      y[i] = x[i];
+      for (pruner::uint k = 0u; k <= i; ++k)
+        y[i] += L[i * d + k] * z[k];
+
+      y[i] = reflect(y[i], ctrl.lb, ctrl.ub);
+
+    }
+
+    double fy = model(&y[0u], W);
+    if (std::log(runif(engine)) < (fy - fx)) {
+      x.swap(y);
+      fx = fy;
+      ++naccepted;
+    }
+
+    // Adapting the proposal
+    if (ctrl.adaptive) {
+
+      for (pruner::uint i = 0u; i < d; ++i) {
+        delta[i] = x[i] - mean[i];
+        mean[i] += delta[i] / step;
+      }
+
+      for (pruner::uint i = 0u; i < d; ++i)
+        for (pruner::uint j = 0u; j < d; ++j)
+          M2[i * d + j] += delta[i] * (x[j] - mean[j]);
+
+      if ((step >= ctrl.warmup) && (step > 1u)) {
+
+        for (pruner::uint i = 0u; i < d; ++i)
+          for (pruner::uint j = 0u; j < d; ++j)
+            S[i * d + j] = sd * (M2[i * d + j] / (step - 1u) +
+              ((i == j) ? ctrl.eps : 0.0));
+
+        // If it fails, the previous proposal is kept
+        cholesky(S, d, L);
+
+      }
+
+    }
+
+    // Saving
+    if ((step > ctrl.burnin) && (((step - ctrl.burnin) % ctrl.thin) == 0u)) {
+
+      std::copy(x.begin(), x.end(), out + (std::size_t) nkept * d);
+      steps[nkept++] = (int) step;
+
+    }
+
+  }
+
+  return (double) naccepted / ctrl.nsteps;
+
+}
+
+/**@brief Native random-walk/adaptive Metropolis sampler over a compiled model.
+ *
+ * Each row of `initial` is the starting point of a chain. Chains run on up to
+ * `nthreads` threads, each one with its own workspaces (see
+ * AphyloModel::acquire), and their random number generators are seeded with
+ * `seeds` (one per chain), so the results don't depend on the number of
+ * threads.
+ *
+ * @return A list with one matrix per chain, each with the step numbers of the
+ * samples as the attribute `"steps"`, and the acceptance rates as the
+ * attribute `"acceptance"`.
+ */
+// [[Rcpp::export(name = ".aphylo_mcmc_native", rng = false)]]
+List aphylo_mcmc_native(
+    SEXP model_ptr,
+    const NumericMatrix & initial,
+    int nsteps,
+    int burnin,
+    int thin,
+    bool adaptive,
+    double scale,
+    int warmup,
+    double eps,
+    const std::vector< double > & seeds,
+    int nthreads = 1
+) {
+
+  Rcpp::XPtr< AphyloModel > model(model_ptr);
+
+  pruner::uint d = model->npars;
+  int nchains = initial.nrow();
+  if ((pruner::uint) initial.ncol() != d)
+    stop("-initial- should have %i columns.", d);
+
+  if ((int) seeds.size() != nchains)
+    stop("-seeds- should have one element per chain.");
+
+  if ((nsteps < 1) || (burnin < 0) || (thin < 1) || (nsteps - burnin < thin))
+    stop("No samples would be kept with the given -nsteps-, -burnin-, and -thin-.");
+
+  McmcControl ctrl = {
+    (pruner::uint) nsteps, (pruner::uint) burnin, (pruner::uint) thin,
+    (pruner::uint) std::max(warmup, 1), adaptive, scale, eps, 0.0, 1.0
+  };
+
+  pruner::uint nkept = (ctrl.nsteps - ctrl.burnin) / ctrl.thin;
+
+  // Row-major copies, so no R objects are touched within the threads
+  pruner::v_dbl x0((std::size_t) nchains * d);
+  for (int c = 0; c < nchains; ++c)
+    for (pruner::uint i = 0u; i < d; ++i)
+      x0[(std::size_t) c * d + i] = initial(c, i);
+
+  std::vector< pruner::v_dbl > samples(nchains, pruner::v_dbl((std::size_t) nkept * d));
+  std::vector< std::vector< int > > steps(nchains, std::vector< int >(nkept));
+  pruner::v_dbl acceptance(nchains);
+  std::vector< std::string > errors(nchains);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads) if (nthreads > 1)
+#endif
+  for (int c = 0; c < nchains; ++c) {
+
+    try {
+
+      std::vector< std::unique_ptr< TreeData > > ws = model->acquire();
+      std::vector< TreeData * > W;
+      for (auto w = ws.begin(); w != ws.end(); ++w)
+        W.push_back(w->get());
+
+      acceptance[c] = mcmc_chain(
+        *model, W, &x0[(std::size_t) c * d], ctrl,
+        (std::uint64_t) seeds[c], &samples[c][0u], &steps[c][0u]
+      );
+
+      model->release(ws);
+
+    } catch (std::exception & e) {
+      errors[c] = e.what();
+    }
+
+  }
+
+  for (int c = 0; c < nchains; ++c)
+    if (errors[c].size())
+      stop(errors[c]);
+
+  List ans(nchains);
+  for (int c = 0; c < nchains; ++c) {
+
+    NumericMatrix m(nkept, d);
+    for (pruner::uint k = 0u; k < nkept; ++k)
+      for (pruner::uint i = 0u; i < d; ++i)
+        m(k, i) = samples[c][(std::size_t) k * d + i];
+
+    m.attr("steps") = wrap(steps[c]);
+
+    ans[c] = m;
+
+  }
+
+  ans.attr("acceptance") = wrap(acceptance);
+
+  return ans;
+
+}
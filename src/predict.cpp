@@ -1,116 +1,410 @@
 #include <Rcpp.h>
 #include "misc.h"
+#include "pruner.hpp"
+#include "TreeData.hpp" // TreeData definition
+#include "loglikelihood.h" // AphyloPruner definition
 using namespace Rcpp;
 
+// Probability of the observed annotation `a` (0, 1, or 9) given state `b`, as
+// in likelihood().
+inline double tip_emission(const TreeData & D, pruner::uint b, pruner::uint a) {
+  
+  if (D.eta[0u] >= 0.0)
+    return (a == 9u) ?
+      (1.0 - D.eta[0u]) * D.PSI[b][0u] + (1.0 - D.eta[1u]) * D.PSI[b][1u] :
+      D.PSI[b][a] * D.eta[a];
+  
+  return (a == 9u) ? 1.0 : D.PSI[b][a];
+  
+}
+
+// Preorder of the entire tree, since the pruning sequence may be reduced.
+inline pruner::v_uint full_preorder(const AphyloPruner & tree) {
+  
+  const pruner::Adjacency & offspring = *tree.get_offspring_ptr();
+  
+  pruner::v_uint preorder, stack(1u, tree.get_postorder_ptr()->back());
+  preorder.reserve(tree.n_nodes());
+  while (stack.size()) {
+    
+    pruner::uint i = stack.back();
+    stack.pop_back();
+    preorder.push_back(i);
+    
+    for (auto o = offspring[i].begin(); o != offspring[i].end(); ++o)
+      stack.push_back(*o);
+    
+  }
+  
+  return preorder;
+  
+}
+
+/**@brief Posterior probabilities of a single function using the pruner.
+ * 
+ * Reads the offspring and the pruning sequence from the tree, and reuses the
+ * probabilities held in `TreeData::Pr`, so these are only recomputed if the
+ * parameters or the annotations changed (see AphyloPruner::update). Nodes not
+ * in the pruning sequence have no data below, so their probabilities are 1.
+ * The probabilities going down are normalized at each node.
+ * 
+ * @return A list with the posterior probabilities and the preorder sequence
+ * (1-indexed).
+ */
 // [[Rcpp::export(name = ".posterior_prob", rng=false)]]
 List posterior_prob(
-    const NumericMatrix  & Pr_postorder,
-    const std::vector< unsigned int > & types,
-    const NumericVector  & mu_d,
-    const NumericVector  & mu_s,
-    const double     & Pi,
-    const IntegerVector & pseq,
-    const List       & offspring
+    SEXP tree_ptr,
+    const std::vector< double > & mu_d,
+    const std::vector< double > & mu_s,
+    const std::vector< double > & psi,
+    const std::vector< double > & eta,
+    const double & Pi
 ) {
   
-  // Creating output objects
-  NumericMatrix Pr_preorder(Pr_postorder.nrow(), Pr_postorder.ncol());
-  for (auto iter = Pr_preorder.begin(); iter != Pr_preorder.end(); ++iter)
-    *iter = 0.0;
+  Rcpp::XPtr< AphyloPruner > p(tree_ptr);
+  TreeData & D = p->D;
+  
+  if (D.nfuns != 1u)
+    stop("The tree has %i functions. Use .posterior_pruner instead.", D.nfuns);
   
-  IntegerVector preorder(pseq.size());
-  NumericVector Posterior(preorder.size());
+  // Postorder
+  D.set_params(mu_d, mu_s, psi, eta, Pi);
+  p->update();
   
-  // Creating Matrix of probabilities
-  std::vector< const NumericVector * > mu(2);
-  mu[0] = & mu_d;
-  mu[1] = & mu_s;
+  const pruner::Adjacency & offspring = *p->get_offspring_ptr();
+  const pruner::v_uint & postorder  = p->get_pseq(D);
+  pruner::uint n = D.n;
   
-  // Generating the preorder
-  std::reverse_copy(pseq.begin(), pseq.end(), preorder.begin());
+  // Nodes in the pruning sequence
+  std::vector< double > Pr_postorder(2u * n, 1.0), Pr_preorder(2u * n), F;
+  for (auto i = postorder.begin(); i != postorder.end(); ++i)
+    pr_row(D, *i, &Pr_postorder[2u * *i]);
   
-  // Iterators definitions
-  typedef IntegerVector::const_iterator iviter;
-  typedef IntegerVector::const_iterator Riviter;
+  pruner::v_uint preorder = full_preorder(*p);
+  NumericVector Posterior(n);
+  IntegerVector pseq(n);
   
   // Starting with the root node
-  Pr_preorder.at(preorder.at(0u) - 1u, 0u) = 
-    Pr_postorder.at(preorder.at(0u) - 1u, 0u)*(1.0 - Pi);
+  Pr_preorder[2u * preorder[0u]]      = 1.0 - D.pi;
+  Pr_preorder[2u * preorder[0u] + 1u] = D.pi;
   
-  Pr_preorder.at(preorder.at(0u) - 1u, 1u) = 
-    Pr_postorder.at(preorder.at(0u) - 1u, 1u)*Pi;
+  for (pruner::uint k = 0u; k < n; ++k) {
+    
+    pruner::uint i = preorder[k];
+    pseq[k] = i + 1;
+    
+    // Computing posterior probabilities
+    const double * pre  = &Pr_preorder[2u * i];
+    const double * post = &Pr_postorder[2u * i];
+    Posterior[i] = pre[1u] * post[1u] / (pre[0u] * post[0u] + pre[1u] * post[1u]);
+    
+    if (offspring[i].size() == 0u)
+      continue;
+    
+    // Transition from each offspring
+    const pruner::Adjacency::Row off = offspring[i];
+    const mat22 & M = (D.types[i] == 0u) ? D.MU_d : D.MU_s;
+    F.resize(2u * off.size());
+    for (pruner::uint o = 0u; o < off.size(); ++o)
+      for (pruner::uint a = 0u; a < 2u; ++a)
+        F[2u * o + a] = M[a][0u] * Pr_postorder[2u * off[o]] +
+          M[a][1u] * Pr_postorder[2u * off[o] + 1u];
+    
+    for (pruner::uint o = 0u; o < off.size(); ++o) {
+      
+      // Computing the joint (D_n^c, x_n), that is, the data outside of the
+      // offspring's subtree
+      double D_n_complement_x_n[2u] = {pre[0u], pre[1u]};
+      for (pruner::uint o2 = 0u; o2 < off.size(); ++o2)
+        if (o2 != o)
+          for (pruner::uint a = 0u; a < 2u; ++a)
+            D_n_complement_x_n[a] *= F[2u * o2 + a];
+      
+      // Joint (D_n^c, x_o), normalized to avoid underflow
+      double * pre_o = &Pr_preorder[2u * off[o]];
+      for (pruner::uint b = 0u; b < 2u; ++b)
+        pre_o[b] = D_n_complement_x_n[0u] * M[0u][b] +
+          D_n_complement_x_n[1u] * M[1u][b];
+      
+      double z = pre_o[0u] + pre_o[1u];
+      if (z > 0.0) {
+        pre_o[0u] /= z;
+        pre_o[1u] /= z;
+      }
+      
+    }
+    
+  }
   
-  // Computing posterior probabilities
-  Posterior.at(preorder.at(0u) - 1u) = Pr_preorder.at(preorder.at(0u) - 1u, 1u)/(
-    Pr_preorder.at(preorder.at(0u) - 1u, 1u) +
-    Pr_preorder.at(preorder.at(0u) - 1u, 0u)
+  return List::create(
+    _["posterior"]  = Posterior,
+    _["pseq"]       = pseq
   );
   
-  double D_n_complement_x_n;
+}
+
+/**@brief Leave-one-out posterior probabilities for all the nodes of the tree.
+ * 
+ * Since the model factorizes across functions, each function is processed as
+ * a tree with two states, the same as `predict_pre_order()` does with
+ * `x[, j]`. For each function, a postorder sweep computes the probability of
+ * the data below each node, and a preorder sweep the probability of the rest
+ * of the data. For tips, the latter gives the posterior probability after
+ * dropping the tip's annotation, so all the leave-one-out predictions come
+ * from the same two sweeps.
+ * 
+ * As in `new_aphylo_pruner(x[, j])`, tips not annotated on function `j` (and
+ * the interior nodes with no annotated descendants) are excluded from the
+ * pruning sequence, so their probabilities are 1. If eta is used, all the
+ * tips are included (see AphyloPruner::use_reduced), and the unannotated ones
+ * contribute their probability of not being annotated. Rows are normalized at
+ * each node, so large trees don't underflow.
+ * 
+ * @return A matrix of size `n x P` with the posterior probabilities. Tips
+ * get the leave-one-out probabilities, and interior nodes the posterior
+ * probabilities given all the data.
+ */
+// [[Rcpp::export(name = ".posterior_loo_pruner", rng = false)]]
+NumericMatrix posterior_loo_pruner(
+    SEXP tree_ptr,
+    const std::vector< double > & mu_d,
+    const std::vector< double > & mu_s,
+    const std::vector< double > & psi,
+    const std::vector< double > & eta,
+    const double & Pi
+) {
+  
+  Rcpp::XPtr< AphyloPruner > p(tree_ptr);
+  TreeData & D = p->D;
+  
+  D.set_params(mu_d, mu_s, psi, eta, Pi);
+  double pi = D.pi;
+  
+  const pruner::Adjacency & offspring = *p->get_offspring_ptr();
+  pruner::uint n = D.n, nfuns = D.nfuns;
   
-  for (iviter n = preorder.begin(); n != preorder.end(); ++n) {
+  pruner::v_uint preorder = full_preorder(*p);
+  
+  NumericMatrix ans(n, nfuns);
+  std::vector< double > In(2u * n), Out(2u * n), F;
+  std::vector< bool > included(n);
+  
+  for (pruner::uint j = 0u; j < nfuns; ++j) {
     
-    // If no offsprings, then nothing to do
-    if (! (bool) Rf_length(offspring.at(*n - 1u))) {
-      continue;
+    // If the function has no annotations (or eta is used), the whole tree is
+    // used
+    bool annotated = false;
+    for (pruner::uint i = 0u; i < n; ++i)
+      if (offspring[i].size() == 0u && D.A[i][j] != 9u) {
+        annotated = true;
+        break;
+      }
+    
+    // Postorder: Probability of the data below each node
+    for (auto i = preorder.rbegin(); i != preorder.rend(); ++i) {
+      
+      double * in = &In[2u * *i];
+      in[0u] = 1.0;
+      in[1u] = 1.0;
+      
+      if (offspring[*i].size() == 0u) {
+        
+        included[*i] = !annotated || D.use_eta() || (D.A[*i][j] != 9u);
+        if (included[*i])
+          for (pruner::uint b = 0u; b < 2u; ++b)
+            in[b] = tip_emission(D, b, D.A[*i][j]);
+        
+      } else {
+        
+        const mat22 & M = (D.types[*i] == 0u) ? D.MU_d : D.MU_s;
+        
+        included[*i] = false;
+        for (auto o = offspring[*i].begin(); o != offspring[*i].end(); ++o) {
+          
+          included[*i] = included[*i] || included[*o];
+          
+          const double * in_o = &In[2u * *o];
+          for (pruner::uint b = 0u; b < 2u; ++b)
+            in[b] *= M[b][0u] * in_o[0u] + M[b][1u] * in_o[1u];
+          
+        }
+        
+        // Not in the pruning sequence, so never updated
+        if (!included[*i])
+          in[0u] = in[1u] = 1.0;
+        
+      }
+      
+      double z = in[0u] + in[1u];
+      if (z > 0.0) {
+        in[0u] /= z;
+        in[1u] /= z;
+      }
+      
     }
     
-    // Obtaining list of offspring <- this can be improved (speed)
-    // can create an std vector of size n
-    IntegerVector O(offspring.at(*n - 1u));
-    
-    for (Riviter o = O.begin(); o != O.end(); ++o) {
-      
-      // Computing the joint (D_n^c, x_n = 0)
-      D_n_complement_x_n = 
-        Pr_preorder.at(*n - 1u, 0) / 
-        (
-            Pr_postorder.at(*o - 1u, 1)*mu[types[*n - 1u]]->at(0) + 
-              Pr_postorder.at(*o - 1u, 0)*(1.0 - mu[types[*n - 1u]]->at(0))
-        ) * (1 -mu[types[*n - 1u]]->at(0)) +
-          Pr_preorder.at(*n - 1u, 1) / 
-          (
-              Pr_postorder.at(*o - 1u, 1)*(1.0-mu[types[*n - 1u]]->at(1)) + 
-                Pr_postorder.at(*o - 1u, 0)*mu[types[*n - 1u]]->at(1)
-          ) * mu[types[*n - 1u]]->at(1)
-      ;
-      
-      
-      Pr_preorder.at(*o - 1u, 0) = Pr_postorder.at(*o - 1u, 0)*
-        D_n_complement_x_n;
-      
-      // Computing the joint (D_n^c, x_n = 1)
-      D_n_complement_x_n = 
-        Pr_preorder.at(*n - 1u, 0) / 
-        (
-            Pr_postorder.at(*o - 1u, 1)*mu[types[*n - 1u]]->at(0) + 
-              Pr_postorder.at(*o - 1u, 0)*(1.0 - mu[types[*n - 1u]]->at(0))
-        ) * mu[types[*n - 1u]]->at(0) +
-          Pr_preorder.at(*n - 1u, 1) / 
-          (
-              Pr_postorder.at(*o - 1u, 1)*(1.0-mu[types[*n - 1u]]->at(1)) + 
-                Pr_postorder.at(*o - 1u, 0)*mu[types[*n - 1u]]->at(1)
-          ) * (1 - mu[types[*n - 1u]]->at(1))
-        ;
-      
-      
-      Pr_preorder.at(*o - 1u, 1) = Pr_postorder.at(*o - 1u, 1)*
-        D_n_complement_x_n;
-      
-      
-      // Computing posterior probabilities
-      Posterior.at(*o - 1) = Pr_preorder.at(*o - 1u, 1)/
-        (Pr_preorder.at(*o - 1u, 1) + Pr_preorder.at(*o - 1u, 0));
+    // Preorder: Probability of the data outside each node
+    Out[2u * preorder[0u]]      = 1.0 - pi;
+    Out[2u * preorder[0u] + 1u] = pi;
+    for (auto i = preorder.begin(); i != preorder.end(); ++i) {
+      
+      const pruner::Adjacency::Row off = offspring[*i];
+      double * out = &Out[2u * *i];
+      
+      // Posterior probabilities. For tips in the pruning sequence, this drops
+      // the annotation (same as setting it to 9).
+      double pr[2u];
+      for (pruner::uint b = 0u; b < 2u; ++b)
+        pr[b] = out[b] * (
+          (off.size() == 0u) && included[*i] ?
+          tip_emission(D, b, 9u) : In[2u * *i + b]
+          );
+      
+      ans(*i, j) = pr[1u] / (pr[0u] + pr[1u]);
+      
+      if (off.size() == 0u)
+        continue;
+      
+      // Transition from each offspring
+      const mat22 & M = (D.types[*i] == 0u) ? D.MU_d : D.MU_s;
+      F.resize(2u * off.size());
+      for (pruner::uint o = 0u; o < off.size(); ++o)
+        for (pruner::uint b = 0u; b < 2u; ++b)
+          F[2u * o + b] =
+            M[b][0u] * In[2u * off[o]] + M[b][1u] * In[2u * off[o] + 1u];
+      
+      for (pruner::uint o = 0u; o < off.size(); ++o) {
+        
+        double msg[2u] = {out[0u], out[1u]};
+        for (pruner::uint o2 = 0u; o2 < off.size(); ++o2)
+          if (o2 != o)
+            for (pruner::uint b = 0u; b < 2u; ++b)
+              msg[b] *= F[2u * o2 + b];
+        
+        double * out_o = &Out[2u * off[o]];
+        for (pruner::uint b = 0u; b < 2u; ++b)
+          out_o[b] = msg[0u] * M[0u][b] + msg[1u] * M[1u][b];
+        
+        double z = out_o[0u] + out_o[1u];
+        if (z > 0.0) {
+          out_o[0u] /= z;
+          out_o[1u] /= z;
+        }
+        
+      }
       
     }
     
   }
   
+  return ans;
+  
+}
+
+/**@brief Posterior probabilities of all the functions from a single pruning.
+ * 
+ * Computes the likelihood on the pruner (see AphyloPruner::update), and then
+ * goes down the tree on the joint space of 2^P states. The message to each
+ * offspring is the probability of the rest of the data (outside of the
+ * offspring's subtree), which is propagated using the factorized transition
+ * (see kron_transition). The joint posterior of each node is then
+ * marginalized to get the probability of each function.
+ * 
+ * @return A list with the `n x P` matrix of posterior probabilities and the
+ * log-likelihood.
+ */
+// [[Rcpp::export(name = ".posterior_pruner", rng = false)]]
+List posterior_pruner(
+    SEXP tree_ptr,
+    const std::vector< double > & mu_d,
+    const std::vector< double > & mu_s,
+    const std::vector< double > & psi,
+    const std::vector< double > & eta,
+    const double & Pi
+) {
+  
+  Rcpp::XPtr< AphyloPruner > p(tree_ptr);
+  TreeData & D = p->D;
+  
+  // Postorder
+  D.set_params(mu_d, mu_s, psi, eta, Pi);
+  p->update();
+  
+  const pruner::Adjacency & offspring = *p->get_offspring_ptr();
+  pruner::uint n = D.n, nfuns = D.nfuns, nstates = D.nstates, s;
+  pruner::v_uint preorder = full_preorder(*p);
+  
+  NumericMatrix ans(n, nfuns);
+  StateMatrix Out(n, nstates, 0.0);
+  std::vector< double > x(nstates), F, msg(nstates);
+  
+  std::copy(D.Pi.begin(), D.Pi.end(), Out[preorder[0u]]);
+  for (auto i = preorder.begin(); i != preorder.end(); ++i) {
+    
+    const pruner::Adjacency::Row off = offspring[*i];
+    double * out = Out[*i];
+    
+    // Joint posterior and marginals
+    pr_row(D, *i, &x[0u]);
+    double z = 0.0;
+    for (s = 0u; s < nstates; ++s) {
+      x[s] *= out[s];
+      z    += x[s];
+    }
+    
+    for (pruner::uint j = 0u; j < nfuns; ++j) {
+      
+      double pr1 = 0.0;
+      for (s = 0u; s < nstates; ++s)
+        if (D.states[s][j])
+          pr1 += x[s];
+      
+      ans(*i, j) = pr1 / z;
+      
+    }
+    
+    if (off.size() == 0u)
+      continue;
+    
+    // Transitions from the offspring
+    const mat22 & M = (D.types[*i] == 0u) ? D.MU_d : D.MU_s;
+    mat22 Mt;
+    for (pruner::uint a = 0u; a < 2u; ++a)
+      for (pruner::uint b = 0u; b < 2u; ++b)
+        Mt[a][b] = M[b][a];
+    
+    F.resize((std::size_t) off.size() * nstates);
+    for (pruner::uint o = 0u; o < off.size(); ++o) {
+      pr_row(D, off[o], &F[(std::size_t) o * nstates]);
+      kron_transition(M, &F[(std::size_t) o * nstates], nfuns, nstates);
+    }
+    
+    for (pruner::uint o = 0u; o < off.size(); ++o) {
+      
+      std::copy(out, out + nstates, msg.begin());
+      for (pruner::uint o2 = 0u; o2 < off.size(); ++o2)
+        if (o2 != o)
+          for (s = 0u; s < nstates; ++s)
+            msg[s] *= F[(std::size_t) o2 * nstates + s];
+      
+      // Back to the offspring's states, normalized to avoid underflow
+      kron_transition(Mt, &msg[0u], nfuns, nstates);
+      
+      z = 0.0;
+      for (s = 0u; s < nstates; ++s)
+        z += msg[s];
+      
+      double * out_o = Out[off[o]];
+      for (s = 0u; s < nstates; ++s)
+        out_o[s] = (z > 0.0) ? msg[s] / z : msg[s];
+      
+    }
+    
+  }
   
   return List::create(
-    _["joint_prob"] = Pr_preorder,
-    _["posterior"]  = Posterior,
-    _["pseq"]       = preorder
+    _["posterior"] = ans,
+    _["ll"]        = D.ll
   );
   
 }